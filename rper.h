@@ -0,0 +1,254 @@
+/*
+rper library interface (librper)
+
+Lets another program run rper jobs in-process, instead of starting the rper binary for each one.
+Every bit of state belongs to a job (struct rper_job), so separate jobs can run at the same time,
+in separate threads, without getting in each others way.
+
+Building the library (leaves out the command line interface, ie. main):
+    gcc -c -DRPER_NO_MAIN -pthread -o librper.o rper.c
+
+Example:
+    struct rper_job job;
+    rper_job_init(&job);
+    if (rper_compile_mode("6*4", &job.mode) == 0) {
+        job.change_files = 1;
+        rper_run(&job, "/some/directory");
+    }
+*/
+
+#ifndef RPER_H
+#define RPER_H
+
+#include <sys/types.h>          // mode_t
+#include <sys/stat.h>           // struct stat, for events
+#include <pthread.h>            // pthread_mutex_t, for the shared throttle
+#include <time.h>               // struct timespec
+#include <stdio.h>              // FILE, for fingerprints
+
+/*
+ * A permissions mode, compiled from the octal/wildcard form the user gives (eg. '6*4').
+ * Applying it is a single bitwise operation: new_mode = (old_mode & keep) | set
+ */
+struct rper_mode {
+    mode_t keep;                // permission bits left alone (the parts given as '*')
+    mode_t set;                 // permission bits to be set
+    char spec[4];               // the mode as given, without any leading zero, for output (eg. "6*4")
+};
+
+/* What happened to an entry */
+enum rper_event_type {
+    RPER_CHANGED,               // permissions were changed
+    RPER_SKIPPED,               // permissions were already as requested
+    RPER_ERROR,                 // something could not be read or changed (see failed, error)
+    RPER_COPY_UP_AVOIDED        // left alone; it's only in a lower overlayfs layer, and changing it would copy it up (see overlay)
+};
+
+/* What to do about entries only in a lower layer of an overlay filesystem, which changing copies up (data and all) */
+enum rper_overlay {
+    RPER_OVERLAY_OFF,           // nothing; overlays aren't looked for
+    RPER_OVERLAY_COUNT,         // change them, counting the copy-ups (and the bytes copied); with check, what they would be
+    RPER_OVERLAY_SKIP,          // leave them alone
+    RPER_OVERLAY_CAP            // change them until the copy-ups would go over overlay_cap bytes, then leave the rest alone
+};
+
+struct rper_walk;
+
+/*
+ * Where an entry is: its name in a directory that is open while the job runs. Files are found from
+ * the directory they are in, so no full path is put together unless it is asked for (rper_event_path).
+ */
+struct rper_entry {
+    struct rper_walk *walk;     // the walk it was found in (NULL if there is only a path)
+    int parent;                 // the directory it is in, as a depth in the walk (-1 where the walk starts)
+    int dirfd;                  // that directory, open (AT_FDCWD where the walk starts)
+    const char *name;           // its name in there (the path given, where the walk starts)
+};
+
+/*
+ * Passed to the job's callback for each entry rper looks at
+ */
+struct rper_event {
+    enum rper_event_type type;
+    const struct rper_entry *entry;	// the file/directory; see rper_event_path for its path
+    int is_dir;                 // 1 for a directory, 0 for a file
+    int selected;               // 1 if this type of entry was selected for changes (change_files/change_dirs)
+    mode_t old_mode;            // permissions before (changed/skipped only)
+    mode_t new_mode;            // permissions after (changed/skipped only)
+    const struct rper_mode *mode;	// the mode applied (changed/skipped only); the job's, or one from a policy
+    const char *failed;         // errors only; what could not be done, eg. "open directory"
+    int error;                  // errors only; the errno value
+    const struct stat *stat;    // changed/skipped only; what the entry's stat found (inode, owner, etc.), before any change
+};
+
+/*
+ * A limit on metadata operations (stat, chmod, opendir) per second, which can be shared
+ * by any number of jobs, so that together they never go over it. Set up with rper_throttle_init.
+ */
+struct rper_throttle {
+    pthread_mutex_t lock;
+    double rate;                // operations allowed per second
+    double tokens;              // operations that can go ahead right now (negative when jobs are waiting)
+    struct timespec last;       // when tokens was last topped up
+};
+
+/*
+ * A count of the permissions found, for files and directories, indexed by mode (0 to 0777)
+ */
+struct rper_mode_counts {
+    long files[512];
+    long dirs[512];
+};
+
+/*
+ * The permissions found by a job, overall and for each top-level subtree of the directory.
+ * It belongs to the job (only ever touched by the thread running it), so counting needs no locking;
+ * histograms from several jobs can be added together afterwards.
+ */
+struct rper_histogram {
+    struct rper_mode_counts total;
+    struct rper_subtree_counts {
+        char *name;             // the top-level entry's name, or "." for the entries directly in the directory
+        struct rper_mode_counts *counts;
+    } *subtrees;
+    int nsubtrees;
+    int capacity;
+};
+
+/*
+ * What a job found when only estimating (see estimate in struct rper_job); directories are read,
+ * but nothing is changed, and entries are only stat'ed when the filesystem can't tell their type,
+ * plus a few, timed, to find what a stat costs
+ */
+#define RPER_LARGEST_DIRS 10
+struct rper_estimate {
+    long entries;               // everything found, of every type
+    long files;
+    long dirs;
+    int max_depth;              // how many levels below the directory the deepest directory is
+    long stats_timed;           // stats made to find what a stat costs
+    double stat_seconds;        // how long those took, altogether
+    struct {
+        long entries;
+        char path[1024];
+    } largest[RPER_LARGEST_DIRS];	// the directories with the most entries, largest first
+    int nlargest;
+};
+
+/*
+ * Fingerprinting (see fingerprint in struct rper_job); nothing is changed, but for each directory a line is written:
+ *     <subtree hash> <local hash> <path>
+ * The local hash covers the name, type and permissions of each entry in the directory, the subtree hash that and
+ * the subtree hashes of its subdirectories, so two trees with the same permissions have the same fingerprints, whatever
+ * order their directories list entries in. Paths are relative ("." for the directory itself), with '\\' and newlines escaped.
+ */
+struct rper_fingerprint {
+    FILE *out;                  // where the lines go
+    long dirs;                  // directories fingerprinted
+    unsigned long long root;    // the subtree hash of the directory itself
+};
+
+/*
+ * Live counters, for watching a job from outside while it runs (see metrics in struct rper_job). The job adds to
+ * them as it goes, with relaxed atomic loads and stores (no locks; only ever one thread writes a field), so any
+ * other thread, or process (they can be in shared memory), can read them at any time, a field at a time.
+ */
+#define RPER_LATENCY_BUCKETS 24
+struct rper_metrics {
+    unsigned long entries;      // entries found
+    unsigned long dirs;         // directories opened
+    unsigned long files_changed;
+    unsigned long dirs_changed;
+    unsigned long errors;
+    unsigned long depth;        // directories open on the walk's stack right now, each still to be finished
+    unsigned long prefetch_queue;	// directories waiting to be read by the prefetch (--prefetch)
+    unsigned long ops;          // stats, chmods and directory opens, timed
+    unsigned long op_nanoseconds;	// how long they took, altogether
+    unsigned long latency[RPER_LATENCY_BUCKETS];	// of those, how many took under 2^i microseconds (the last, any longer)
+};
+
+struct rper_job;
+typedef void (*rper_event_fn)(const struct rper_job *job, const struct rper_event *event, void *user);
+
+/*
+ * A single rper job; its settings, and its results
+ */
+struct rper_job {
+    /* settings, filled in by the caller (after rper_job_init) */
+    struct rper_mode mode;      // the permissions to apply, see rper_compile_mode
+    int change_files;           // change files
+    int change_dirs;            // change directories
+    int recursive;              // descend into subdirectories (default 1)
+    int include_dir;            // also change the given directory itself (with change_dirs only)
+    int report_all;             // report skipped entries of types not selected too (verbose)
+    rper_event_fn on_event;     // called for each entry looked at, may be NULL
+    void *user;                 // passed through to on_event
+    struct rper_throttle *throttle;	// shared limit on metadata operations, may be NULL (no limit)
+    int check;                  // only look, change nothing; entries that would change are reported (and counted) as changed
+    struct rper_histogram *histogram;	// if set (zeroed by the caller), counts the permissions of every file/directory
+    double sample_rate;         // if set (0 to 1), only this fraction of the entries of the selected types are looked at (use with check)
+    unsigned long long sample_seed;	// seeds the random sampling; the same seed picks the same entries
+    struct rper_estimate *estimate;	// if set (zeroed by the caller), only count; nothing is changed or reported (no mode needed)
+    double op_timeout;          // if set, seconds a single stat/chmod/directory read may take; past that, what it was on is abandoned
+    int policy;                 // if set, '.rperpolicy' files in the directories walked give the modes below them
+    enum rper_overlay overlay;  // on an overlay filesystem, what to do about entries only in a lower layer (Linux only)
+    unsigned long long overlay_cap;	// with RPER_OVERLAY_CAP, the most bytes copy-ups may copy
+    int verify;                 // if set, what's changed is read back (past any cache, where possible) once each directory is done; see mismatches
+    int prefetch;               // if set, this many threads read directories and stat entries ahead of the walk, to warm the cache (not with a throttle)
+    struct rper_metrics *metrics;	// if set (zeroed by the caller), kept up to date as the job runs, for monitoring
+    struct rper_fingerprint *fingerprint;	// if set (zeroed by the caller, out set), only fingerprint; nothing is changed or reported (no mode needed)
+
+    /* results */
+    long files_changed;         // count of files changed
+    long dirs_changed;          // count of directories changed
+    long errors;                // count of errors reported
+    long entries_seen;          // sampling only; entries of the selected types found
+    long entries_sampled;       // sampling only; of those, the entries looked at
+    long copy_ups;              // with overlay; entries copied up from a lower layer (or that would be, with check)
+    unsigned long long copy_up_bytes;	// and the bytes of file data that took
+    long copy_ups_avoided;      // entries left alone, rather than copied up
+    long verified;              // with verify; changes read back
+    struct rper_mismatch {
+        char *path;
+        mode_t expected;        // the permissions it was given
+        mode_t found;           // and what it had, read back
+    } *mismatches;              // with verify; changes that didn't stick; see rper_job_free
+    int nmismatches;
+    char **unverified;          // with verify and op_timeout; paths changed, but whose read back was given up on; see rper_job_free
+    int nunverified;
+    char **abandoned;           // with op_timeout; paths (and everything in them) given up on, to be retried; see rper_job_free
+    int nabandoned;
+
+    /* used while running */
+    int subtree;                // the histogram subtree being counted into
+    struct rper_walk *walk;     // the walk, kept between runs for reuse (internal; see rper_job_free)
+};
+
+/* Sets up a job with the defaults (recursive, nothing selected, no mode, no callback) */
+void rper_job_init(struct rper_job *job);
+
+/* Compiles a mode like '755', '0644' or '6*4'. Returns 0 on success, -1 if the mode is invalid */
+int rper_compile_mode(const char *spec, struct rper_mode *mode);
+
+/*
+ * Applies the job to a single file/directory (eg. one that has just appeared). If descend is set and it is
+ * a directory, everything in it is processed too (if the job is recursive). Returns 0 if there were no errors, otherwise -1
+ */
+int rper_apply(struct rper_job *job, const char *path, int descend);
+
+/* Returns the path of the file/directory an event is about; only valid until the callback returns */
+const char *rper_event_path(const struct rper_event *event);
+
+/* Frees what a job has allocated (the abandoned, unverified and mismatches lists, and the walk it keeps for reuse); call once done with it */
+void rper_job_free(struct rper_job *job);
+
+/* Frees what a histogram has allocated (not the histogram itself) */
+void rper_histogram_free(struct rper_histogram *histogram);
+
+/* Sets up a throttle allowing ops_per_sec metadata operations per second, across every job using it */
+void rper_throttle_init(struct rper_throttle *throttle, double ops_per_sec);
+
+/* Runs the job over the given directory. Returns 0 if there were no errors, otherwise -1 */
+int rper_run(struct rper_job *job, const char *dir_path);
+
+#endif
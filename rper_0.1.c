@@ -5,7 +5,9 @@ Version: [see below]
 Originally released under the MIT License at https://github.com/dhitchenor/rper, as a way to assist with my learning of the C language
 
 Usage:
-rper [-f | -d] [-i] [-n] [-s | -S | -v] [-p mode] <directory> [-h | -H] [-a]
+rper [-f | -d] [-i] [-n] [-c] [-s | -S | -v] [-p mode] [--printf template] [--check | --sample rate | --estimate] [--histogram] [--watch] [--max-ops n] [--timeout secs] [--prefetch n] [--policy] [--fingerprint file] [--on-change cmd] [--overlay count|skip|cap:size] [--verify] [--stats-file file] [--prom-file file] <directory> [-h | -H] [-a]
+rper --compare <file> <file>
+rper --daemon <socket> [--workers n] [--max-ops n] [--timeout secs]
 
 Flags:
     files (-f):
@@ -23,279 +25,4353 @@ Flags:
     non-recursive (-n):
     - only makes changes to the files/directories within the specified directory (directory argument).. essentially the basic use of the chmod command
 
-	rwx notation output (-c) (prospective functionality):
-    - display permissions in the output in rwx notation instead of octal
+    rwx notation output (-c):
+    - display permissions in the output in rwx notation instead of octal (eg. rw-r--r-- instead of 644)
+
+    custom output (--printf template):
+    - prints each change/skip as the template says, instead of the built-in format; no newline is added (use \n)
+    - fields: %p path, %n name, %t type (F/D), %a changed or skipped (C/S), %o %O old/new permissions in octal,
+      %r %R old/new permissions in rwx notation, %w the mode given, %i inode, %u uid, %g gid, %d depth, %% a '%'
 
     quiet (-s):
     - suppresses normal output, but still displays any error output
     - retained as default, if both suppressing flags are given
 
-    silenced (-S):
-    - suppresses all output, including errors
-    - defaults to -s flag, if both supressing flags are given
-    
-    verbose (-v):
-    - displays all output; both directory and file changes are provided in output, regardless of flag given
-    - both suppressing flags are ignored if given
+    silenced (-S):
+    - suppresses all output, including errors
+    - defaults to -s flag, if both supressing flags are given
+    
+    verbose (-v):
+    - displays all output; both directory and file changes are provided in output, regardless of flag given
+    - both suppressing flags are ignored if given
+
+    permissions (-p):
+    - uses an octal formatted argument (eg. 755 or 0644) as the desired changed permissions.
+    - allows the use of (*) as a wildcard, eg 6*4 will change the user (left-most), and others (right-most) permissions, but not the group(center) permission
+    
+    help (-h | -H):
+    - displays help for the user
+    
+    about (-a):
+    - displays information about rper
+
+    check (--check):
+    - makes no changes; shows what would change instead, and exits with failure (1) if anything would change,
+      or with 2 if nothing would, but not everything could be looked at (eg. unreadable directories)
+    - for checking a directory is as it should be (eg. compliance audits)
+
+    histogram (--histogram):
+    - shows how many files/directories have each permissions, for the whole directory and each top-level subtree
+    - every file/directory is looked at, not only those being changed; can be used with --check
+
+    sample (--sample rate):
+    - like --check, but only looks at a random sample of the files/directories (eg. 0.01 or 1%), every directory is still read
+    - estimates how many of all of them would change, with a 95% confidence interval; exits the same way as --check
+
+    estimate (--estimate):
+    - makes no changes; only reads directories, to count entries, find the deepest and largest directories,
+      and estimate how long a full run would take (timing a few stats to find what they cost)
+    - no permissions (-p) needed
+
+    watch (--watch):
+    - after the first pass, keeps running, and changes new, moved in, or altered files/directories as they appear
+    - uses fanotify (whole filesystems) when run as root, otherwise inotify (every directory); Linux only
+    - if the kernel drops events (too much changing at once), the whole directory is rescanned, not just part of it
+
+    max operations (--max-ops n):
+    - limits the stats/chmods rper makes to n per second, to go easy on busy (eg. network) filesystems
+
+    timeout (--timeout secs):
+    - gives up on any single stat/chmod/directory read taking longer than secs (eg. a hung network mount),
+      and carries on with the rest; what was given up on is listed at the end, to be retried later (and rper exits with failure)
+
+    prefetch (--prefetch n):
+    - n threads read directories and stat entries ahead of the walk, so it mostly finds them already cached;
+      worth it on cold caches (eg. network filesystems); the output and its order are unchanged
+    - can't be used with --max-ops
+
+    policy (--policy):
+    - honours a '.rperpolicy' file in any directory, giving the modes for everything below it (inherited,
+      nearest first); lines are 'file-mode MODE', 'dir-mode MODE', 'mode MODE', 'rule GLOB MODE', 'exclude GLOB'
+    - -p is then only the default (and can be left out, changing nothing outside any policy); can't be used with --watch
+
+    on change (--on-change cmd):
+    - runs cmd (through /bin/sh) on the changed files/directories, as arguments, in batches as big as a command line allows,
+      like 'find -exec cmd {} +'; a few batches run at once, while the walk goes on (eg. to invalidate caches)
+    - can't be used with --check, --sample, --estimate or --fingerprint; exits with failure if cmd fails
+
+    overlay (--overlay count|skip|cap:size):
+    - on an overlay filesystem (eg. a container's), changing anything only in a lower layer copies it up, data and all;
+      rper follows the upper layer along with the walk, so it knows which entries those are before changing them
+    - count: changes them, and says how many were copied up (and how much data); skip: leaves them alone (shown as 'O');
+      cap:size: changes them until the data copied would go over size (eg. 500M, 2G), then leaves the rest alone
+    - --check counts them on its own, to show what a run would copy up; Linux only, and usually needs root (to see the upper layer)
+
+    verify (--verify):
+    - once each directory is done, reads back the permissions of what was changed in it (on Linux, asking the server,
+      not its cache, on network filesystems), so changes a filesystem took but didn't keep are caught
+    - the summary lists any that don't match, with the permissions set and found, and rper exits with failure
+    - can't be used with --check, --sample, --estimate or --fingerprint
+
+    metrics (--stats-file file) (--prom-file file):
+    - publishes live counters while rper runs, for monitoring: entries found, directories, changes, errors,
+      the directories still open on the walk's stack (and the prefetch's queue), and how long operations take
+    - --stats-file maps the file into memory, and the counters are kept right there (a struct stats_file);
+      --prom-file is rewritten every few seconds, in Prometheus' text format (atomically; written, then renamed)
+    - not with --daemon
+
+    fingerprint (--fingerprint file):
+    - makes no changes; writes a line for each directory to file: '<subtree hash> <local hash> <path>', where the
+      local hash covers the name, type and permissions of everything in it, and the subtree hash that and everything below
+    - the same permissions give the same hashes, whatever order the entries are listed in; no permissions (-p) needed
+
+    compare (--compare file file):
+    - compares two fingerprint files (eg. from replicas); if the hashes of the directories themselves match,
+      only the last line of each file is read; otherwise both are read in full, and only subtrees whose hashes differ are compared
+    - shows the directories whose own entries differ, and those only in one; exits with failure if anything differs
+
+    daemon (--daemon socket) (--workers n):
+    - keeps rper running (rperd), taking jobs over the given Unix socket, and running up to n (default 4) at once
+    - each job is sent as its arguments, one per line, ending with an empty line (within 10 seconds); its output is sent back
+    - with --max-ops, the limit is shared by every job the daemon runs, and --timeout applies to every job
+
+C Language notes:
+- strings are in the form of arrays; C doesn't really have 'strings' like other languages
+	so each character is a position in an array
+- mode_t is a data type used to represent file modes or file permissions, originally defined in <sys/types.h>
+    - read -> 4, write -> 2, execute -> 1
+    - user <rwx>, group <rwx>, others <rwx>
+    - eg. rwxrw-r-x -> 4+2+1(7), 4+2(6), 4+1(5) -> 765
+*/
+
+#define _GNU_SOURCE             // struct ucred, for checking who connects to the daemon (Linux); harmless elsewhere
+
+#include <stdio.h>              // Standard Input/Output Library, for input and output functions (like printf, fprintf)
+#include <stdlib.h>             // General Purpose Standard Library, for standard library functions (like exit, malloc, etc.)
+#include <string.h>             // used not only for string handling, but various memory handling functions (like strlen, strcpy, etc.)
+#include <dirent.h>             // constructs that facilitate directory traversing, for reading directories (opendir, readdir, closedir)
+#include <sys/stat.h>           // contains constructs that facilitate getting information about files attributes, (chmod, stat)
+#include <unistd.h>             // provides access to the POSIX operating system API, for POSIX API functions (like getopt)
+#include <errno.h>              // macros to report error conditions through error codes stored in 'errno' (provides errno and strerror)
+#include <time.h>               // clock_gettime and nanosleep, for the throttle
+#include <pthread.h>            // threads and mutexes; jobs can run side by side (see the daemon mode)
+#include <getopt.h>             // getopt_long, for the options that only have a long name (eg. --daemon)
+#include <signal.h>             // signal, to ignore SIGPIPE in the daemon
+#include <sys/socket.h>         // sockets, for the daemon
+#include <sys/un.h>             // Unix domain socket addresses (struct sockaddr_un)
+#include <limits.h>             // PATH_MAX
+#include <math.h>               // sqrt, for the confidence interval of a sample
+#include <fnmatch.h>            // fnmatch, for the globs in policy files
+#include <spawn.h>              // posix_spawn, to run --on-change commands
+#include <sys/wait.h>           // waitpid, for the --on-change commands
+#include <sys/mman.h>           // mmap, for the stats file (--stats-file)
+#include <stddef.h>             // offsetof, for writing the metrics
+#include <fcntl.h>              // fstatat flags for the prefetch; open, open_by_handle_at, for the watch mode
+#include <poll.h>               // poll, for the daemon's clients' requests (with a deadline)
+#ifdef __linux__
+#include <mntent.h>             // reading the mount table, to watch filesystems mounted inside the directory
+#include <sys/inotify.h>        // inotify, watching directories for changes
+#include <sys/fanotify.h>       // fanotify, watching whole filesystems for changes (root only)
+#include <sys/vfs.h>            // statfs, to tell filesystems apart
+#endif
+#include "rper.h"               // the library interface (librper); the job, mode and event structures
+
+/* Global flags */
+// Nothing that changes while running lives here; all of that belongs to a job (struct rper_job, see rper.h)
+const char version[4] = "0.1";				// version number, as a string (array)
+
+/* Latency injection (development builds only) */
+/*
+ * Building with -DRPER_INJECT_LATENCY makes rper sleep before each metadata syscall (each stat, chmod,
+ * directory open, and each read of a directory's entries from the filesystem; the prefetch's too),
+ * so the behaviour of a slow network filesystem can be reproduced on a local disk, eg.
+ *   gcc -DRPER_INJECT_LATENCY -o rper rper.c -pthread -lm
+ *   RPER_LATENCY_US=800 RPER_LATENCY_SIGMA=0.5 RPER_STALL_PERMILLE=1 RPER_STALL_MS=3000 ./rper -s -p 644 /some/dir
+ *
+ * It is configured through the environment:
+ *   RPER_LATENCY_US      median delay per call, in microseconds (unset or 0 disables the injection)
+ *   RPER_LATENCY_SIGMA   spread of a lognormal distribution around the median (unset or 0 is a fixed delay)
+ *   RPER_STALL_PERMILLE  chance, per thousand calls, of an occasional long stall
+ *   RPER_STALL_MS        length of those stalls, in milliseconds
+ *   RPER_LATENCY_SEED    where the random delays start from (default 12345); each thread gets its own sequence from it,
+ *                        numbered in the order the threads first make a call, so the same run with the same seed
+ *                        stalls in the same places, but the walk, its replacement threads and the prefetch don't all
+ *                        stall at once
+ * Normal builds compile all of this away to nothing.
+ */
+#ifdef RPER_INJECT_LATENCY
+
+static double latency_median_us = 0, latency_sigma = 0, latency_stall_ms = 0;
+static int latency_stall_permille = 0;
+static unsigned int latency_seed = 12345;
+static unsigned int latency_threads = 0;		// threads that have had their seed
+static pthread_once_t latency_once = PTHREAD_ONCE_INIT;
+
+/*
+ * This function reads the settings from the environment; once, whichever thread (daemon worker,
+ * walk, prefetch) gets there first, and before any of them uses them
+ */
+static void latency_configure(void) {
+    char *value;
+    if ((value = getenv("RPER_LATENCY_US")) != NULL) latency_median_us = atof(value);
+    if ((value = getenv("RPER_LATENCY_SIGMA")) != NULL) latency_sigma = atof(value);
+    if ((value = getenv("RPER_STALL_PERMILLE")) != NULL) latency_stall_permille = atoi(value);
+    if ((value = getenv("RPER_STALL_MS")) != NULL) latency_stall_ms = atof(value);
+    if ((value = getenv("RPER_LATENCY_SEED")) != NULL) latency_seed = strtoul(value, NULL, 10);
+}
+
+void inject_latency() {
+    static _Thread_local unsigned int seed;
+    static _Thread_local int seeded = 0;
+    pthread_once(&latency_once, latency_configure);
+    if (!seeded) {
+        // The thread's number, spread over the bits (Knuth's multiplicative hash), mixed into the seed
+        unsigned int thread = __atomic_add_fetch(&latency_threads, 1, __ATOMIC_RELAXED);
+        seed = latency_seed ^ (thread * 2654435761u);
+        seeded = 1;
+    }
+    double median_us = latency_median_us, sigma = latency_sigma, stall_ms = latency_stall_ms;
+    int stall_permille = latency_stall_permille;
+
+    double delay_us = median_us;
+    if (sigma > 0) {
+        // Box-Muller gives a normally distributed number, exp() of that is lognormal
+        double u1 = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+        double u2 = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+        delay_us *= exp(sigma * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+    }
+    if (stall_permille > 0 && rand_r(&seed) % 1000 < stall_permille) {
+        delay_us += stall_ms * 1000.0;			// every so often, the 'server' goes away for a while
+    }
+
+    if (delay_us >= 1) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(delay_us / 1000000);
+        ts.tv_nsec = (long)((delay_us - ts.tv_sec * 1000000.0) * 1000);
+        nanosleep(&ts, NULL);
+    }
+}
+#else
+#define inject_latency()
+#endif
+
+/* Throttle */
+/*
+ * This function sets up a throttle (token bucket), allowing ops_per_sec metadata operations
+ * per second across every job using it; with up to a second's worth allowed in a burst
+ */
+void rper_throttle_init(struct rper_throttle *throttle, double ops_per_sec) {
+    pthread_mutex_init(&throttle->lock, NULL);
+    throttle->rate = ops_per_sec;
+    throttle->tokens = ops_per_sec;
+    clock_gettime(CLOCK_MONOTONIC, &throttle->last);
+}
+
+/*
+ * This function waits, if needed, until the throttle allows another operation.
+ * Each caller takes its token straight away (the count can go negative), then sleeps
+ * for as long as it takes the rate to pay that back; so waiting jobs are served in turn.
+ */
+void throttle_wait(struct rper_throttle *throttle) {
+    struct timespec now;
+    double wait = 0;
+
+    pthread_mutex_lock(&throttle->lock);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - throttle->last.tv_sec) + (now.tv_nsec - throttle->last.tv_nsec) / 1e9;
+    throttle->last = now;
+    throttle->tokens += elapsed * throttle->rate;	// top up for the time that has passed
+    if (throttle->tokens > throttle->rate) {
+        throttle->tokens = throttle->rate;		// but never more than a second's worth
+    }
+    throttle->tokens -= 1;
+    if (throttle->tokens < 0) {
+        wait = -throttle->tokens / throttle->rate;
+    }
+    pthread_mutex_unlock(&throttle->lock);
+
+    if (wait > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Metrics */
+/*
+ * The job's metrics (if it has any) are only written by the thread running the job (the prefetch's queue,
+ * under the prefetch's lock), so a relaxed load and store is enough; no locked instructions on the way.
+ */
+#define METRIC_ADD(metrics, field, n) \
+    __atomic_store_n(&(metrics)->field, __atomic_load_n(&(metrics)->field, __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define METRIC_SET(metrics, field, value) \
+    __atomic_store_n(&(metrics)->field, (value), __ATOMIC_RELAXED)
+
+/*
+ * This function starts timing a metadata operation, if the job has metrics
+ */
+static inline void metrics_op_start(const struct rper_job *job, struct timespec *start) {
+    if (job->metrics) {
+        clock_gettime(CLOCK_MONOTONIC, start);
+    }
+}
+
+/*
+ * This function adds a metadata operation, and how long it took, to the job's metrics (if it has any)
+ */
+static inline void metrics_op_done(const struct rper_job *job, const struct timespec *start) {
+    if (!job->metrics) {
+        return;
+    }
+    int saved_errno = errno;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long ns = (end.tv_sec - start->tv_sec) * 1000000000UL + end.tv_nsec - start->tv_nsec;
+    int bucket = 0;
+    for (unsigned long us = ns / 1000; us && bucket < RPER_LATENCY_BUCKETS - 1; us >>= 1) {
+        bucket++;								// under 2^bucket microseconds
+    }
+    METRIC_ADD(job->metrics, ops, 1);
+    METRIC_ADD(job->metrics, op_nanoseconds, ns);
+    METRIC_ADD(job->metrics, latency[bucket], 1);
+    errno = saved_errno;
+}
+
+/* Reading directories */
+/*
+ * readdir allocates a DIR, and its buffer, for every directory it opens. On Linux, rper reads
+ * directories with getdents64 instead, straight into a buffer the reader keeps and reuses for the
+ * next directory, so once the walk has been as deep as it goes, reading directories allocates nothing.
+ * Elsewhere, it's readdir as usual.
+ */
+#define DIR_BUFFER 32768						// bytes of directory entries read at a time
+
+#ifdef __linux__
+typedef struct dirent64 dir_entry;
+#else
+typedef struct dirent dir_entry;
+#endif
+
+struct dir_reader {
+    int fd;									// the open directory
+#ifdef __linux__
+    char *buffer;							// DIR_BUFFER bytes, allocated on first use and kept
+    int used;								// bytes of entries in it
+    int offset;								// where the next one is
+#else
+    DIR *dir;
+#endif
+};
+
+/*
+ * This function gives the reader its buffer, if it hasn't one yet (elsewhere than Linux, readdir has its own).
+ * Returns 0 on success, otherwise -1 (with errno set).
+ */
+int dir_reader_init(struct dir_reader *reader) {
+#ifdef __linux__
+    if (!reader->buffer && !(reader->buffer = malloc(DIR_BUFFER))) {
+        errno = ENOMEM;
+        return -1;
+    }
+#else
+    (void)reader;
+#endif
+    return 0;
+}
+
+/*
+ * This function opens a directory (by its name, in the directory dirfd) for reading.
+ * Returns 0 on success, otherwise -1 (with errno set).
+ */
+int dir_open(struct dir_reader *reader, int dirfd, const char *name) {
+    if (dir_reader_init(reader) != 0) {
+        return -1;
+    }
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+#ifdef __linux__
+    reader->used = reader->offset = 0;
+#else
+    if (!(reader->dir = fdopendir(fd))) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+#endif
+    reader->fd = fd;
+    return 0;
+}
+
+/*
+ * This function returns the next entry in the directory, or NULL once there are none left
+ * (or it can't be read any further, the same as readdir)
+ */
+dir_entry *dir_read(struct dir_reader *reader) {
+#ifdef __linux__
+    if (reader->offset >= reader->used) {
+        ssize_t n = getdents64(reader->fd, reader->buffer, DIR_BUFFER);
+        if (n <= 0) {
+            return NULL;
+        }
+        reader->used = n;
+        reader->offset = 0;
+    }
+    dir_entry *entry = (dir_entry *)(reader->buffer + reader->offset);
+    reader->offset += entry->d_reclen;
+    return entry;
+#else
+    return readdir(reader->dir);
+#endif
+}
+
+/*
+ * This function tells whether the next dir_read has to go to the filesystem for more entries
+ * (rather than take one from the buffer); elsewhere than Linux, readdir keeps that to itself
+ */
+int dir_read_pending(const struct dir_reader *reader) {
+#ifdef __linux__
+    return reader->offset >= reader->used;
+#else
+    (void)reader;
+    return 1;
+#endif
+}
+
+/*
+ * This function closes the directory; the reader (and its buffer) can be used for the next one
+ */
+void dir_close(struct dir_reader *reader) {
+#ifdef __linux__
+    close(reader->fd);
+#else
+    closedir(reader->dir);
+#endif
+}
+
+/*
+ * This function gives the reader a copy of its buffer, leaving the old one (in left) to a thread stuck on
+ * something in it (see op_timeout); the entries still to be read carry on from the copy
+ */
+void dir_reader_unshare(struct dir_reader *reader, struct dir_reader *left) {
+    *left = *reader;
+#ifdef __linux__
+    char *copy = malloc(DIR_BUFFER);
+    if (copy) {
+        memcpy(copy, reader->buffer, reader->used);
+    } else {
+        reader->used = reader->offset = 0;		// the rest of the directory is given up on too
+    }
+    reader->buffer = copy;
+#else
+    (void)reader;								// readdir's buffer belongs to its DIR, and can't be taken over
+#endif
+}
+
+/*
+ * This function frees the reader's buffer, once it won't be used again
+ */
+void dir_reader_free(struct dir_reader *reader) {
+#ifdef __linux__
+    free(reader->buffer);
+    reader->buffer = NULL;
+#else
+    (void)reader;
+#endif
+}
+
+/* Policies */
+/*
+ * With policy set (--policy), a directory can have a '.rperpolicy' file, giving the modes for
+ * everything below it; so different teams' subtrees can each have their own, in one walk. One line each:
+ *     file-mode MODE      files get MODE
+ *     dir-mode MODE       directories get MODE
+ *     mode MODE           both
+ *     rule GLOB MODE      entries whose name matches GLOB (eg. *.sh) get MODE
+ *     exclude GLOB        entries whose name matches GLOB are left alone (directories, with everything in them)
+ * Blank lines and lines starting with '#' are ignored. A policy inherits from the one above it; its own
+ * rules and modes come first, and anything it doesn't say comes from above (and, at the top, from -p).
+ * Which types are changed is still up to -f/-d. Each file is parsed once, when its directory is opened,
+ * and shared (counted references) by the directories below it on the walk's stack.
+ */
+#define POLICY_FILE ".rperpolicy"
+#define POLICY_MAX_SIZE 65536					// the biggest policy file read; anything bigger is taken to be a mistake
+
+struct policy_rule {
+    char *glob;
+    struct rper_mode mode;
+};
+
+struct rper_policy {
+    int refs;								// the walk's frames using it, and policies inheriting from it
+    struct rper_policy *parent;				// the policy above this one, or NULL
+    int has_file_mode;
+    int has_dir_mode;
+    struct rper_mode file_mode;
+    struct rper_mode dir_mode;
+    struct policy_rule *rules;				// in the order given; the first match wins
+    int nrules;
+    char **excludes;
+    int nexcludes;
+};
+
+/*
+ * This function takes a reference to a policy (which may be NULL); returns the policy
+ */
+struct rper_policy *policy_ref(struct rper_policy *policy) {
+    if (policy) {
+        policy->refs++;
+    }
+    return policy;
+}
+
+/*
+ * This function drops a reference to a policy, freeing it (and dropping its reference to the one above) with the last
+ */
+void policy_unref(struct rper_policy *policy) {
+    while (policy && --policy->refs == 0) {
+        struct rper_policy *parent = policy->parent;
+        for (int i = 0; i < policy->nrules; i++) {
+            free(policy->rules[i].glob);
+        }
+        for (int i = 0; i < policy->nexcludes; i++) {
+            free(policy->excludes[i]);
+        }
+        free(policy->rules);
+        free(policy->excludes);
+        free(policy);
+        policy = parent;
+    }
+}
+
+/*
+ * This function reads one line of a policy into it. Returns 0 on success, -1 if the line isn't valid.
+ */
+int policy_parse_line(struct rper_policy *policy, char *line) {
+    char *words[3];
+    char *save;									// strtok_r, not strtok; jobs in other threads may be parsing policies too
+    int nwords = 0;
+    for (char *word = strtok_r(line, " \t\r\n", &save); word; word = strtok_r(NULL, " \t\r\n", &save)) {
+        if (nwords == 3) {
+            return -1;
+        }
+        words[nwords++] = word;
+    }
+    if (nwords == 0 || words[0][0] == '#') {
+        return 0;
+    }
+
+    if (nwords == 2 && (strcmp(words[0], "file-mode") == 0 || strcmp(words[0], "dir-mode") == 0 ||
+            strcmp(words[0], "mode") == 0)) {
+        struct rper_mode mode;
+        if (rper_compile_mode(words[1], &mode) != 0) {
+            return -1;
+        }
+        if (words[0][0] != 'd') {				// file-mode, or mode
+            policy->file_mode = mode;
+            policy->has_file_mode = 1;
+        }
+        if (words[0][0] != 'f') {				// dir-mode, or mode
+            policy->dir_mode = mode;
+            policy->has_dir_mode = 1;
+        }
+        return 0;
+    }
+    if (nwords == 3 && strcmp(words[0], "rule") == 0) {
+        struct policy_rule *rules = realloc(policy->rules, (policy->nrules + 1) * sizeof(*rules));
+        if (!rules) {
+            return -1;
+        }
+        policy->rules = rules;
+        if (rper_compile_mode(words[2], &rules[policy->nrules].mode) != 0 ||
+                !(rules[policy->nrules].glob = strdup(words[1]))) {
+            return -1;
+        }
+        policy->nrules++;
+        return 0;
+    }
+    if (nwords == 2 && strcmp(words[0], "exclude") == 0) {
+        char **excludes = realloc(policy->excludes, (policy->nexcludes + 1) * sizeof(char *));
+        if (!excludes) {
+            return -1;
+        }
+        policy->excludes = excludes;
+        if (!(excludes[policy->nexcludes] = strdup(words[1]))) {
+            return -1;
+        }
+        policy->nexcludes++;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * This function loads the policy file in a directory (dirfd), if it has one, inheriting from parent.
+ * Returns 0 with *policy set to the new policy, or to parent (with a new reference) if there is no file;
+ * otherwise -1, with errno set (EINVAL if the file isn't valid, or isn't a regular file; EFBIG if it's too big).
+ * Anyone who can write in the directory can put a policy file there, so it's opened without blocking (a FIFO
+ * would otherwise hang the run until someone writes to it), and only a regular file of a sensible size is read.
+ */
+int policy_load(int dirfd, struct rper_policy *parent, struct rper_policy **policy) {
+    int fd = openat(dirfd, POLICY_FILE, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            *policy = policy_ref(parent);		// nothing new here; the same as above
+            return 0;
+        }
+        return -1;
+    }
+    struct stat statbuf;
+    int error = 0;
+    if (fstat(fd, &statbuf) != 0) {
+        error = errno;
+    } else if (!S_ISREG(statbuf.st_mode)) {
+        error = EINVAL;							// eg. a FIFO, or a device
+    } else if (statbuf.st_size > POLICY_MAX_SIZE) {
+        error = EFBIG;
+    }
+    if (error) {
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    FILE *file = fdopen(fd, "r");
+    struct rper_policy *loaded = calloc(1, sizeof(*loaded));
+    if (!file || !loaded) {
+        file ? fclose(file) : close(fd);
+        free(loaded);
+        errno = ENOMEM;
+        return -1;
+    }
+    loaded->refs = 1;
+    loaded->parent = policy_ref(parent);
+
+    char line[1024];
+    int valid = 1;
+    size_t size = 0;							// read so far; it may have grown since the fstat
+    while (valid && size <= POLICY_MAX_SIZE && fgets(line, sizeof(line), file)) {
+        size += strlen(line);
+        valid = policy_parse_line(loaded, line) == 0;
+    }
+    fclose(file);
+    if (!valid || size > POLICY_MAX_SIZE) {
+        policy_unref(loaded);
+        errno = valid ? EFBIG : EINVAL;
+        return -1;
+    }
+    *policy = loaded;
+    return 0;
+}
+
+/*
+ * This function decides whether an entry is excluded by a policy (or any policy above it)
+ */
+int policy_excludes(const struct rper_policy *policy, const char *name) {
+    for (; policy; policy = policy->parent) {
+        for (int i = 0; i < policy->nexcludes; i++) {
+            if (fnmatch(policy->excludes[i], name, FNM_PERIOD) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * This function finds the mode for an entry under a policy; the first matching rule, nearest first,
+ * then the nearest mode for its type, then the given mode (-p)
+ */
+const struct rper_mode *policy_mode(const struct rper_policy *policy, const char *name, int is_dir,
+                                    const struct rper_mode *mode) {
+    for (const struct rper_policy *p = policy; p; p = p->parent) {
+        for (int i = 0; i < p->nrules; i++) {
+            if (fnmatch(p->rules[i].glob, name, FNM_PERIOD) == 0) {
+                return &p->rules[i].mode;
+            }
+        }
+    }
+    for (const struct rper_policy *p = policy; p; p = p->parent) {
+        if (is_dir ? p->has_dir_mode : p->has_file_mode) {
+            return is_dir ? &p->dir_mode : &p->file_mode;
+        }
+    }
+    return mode;
+}
+
+/* The walk */
+/*
+ * rper walks the directory depth first, keeping the directories it is part way through on a stack
+ * that belongs to the job, rather than on the stack of the thread doing the walking. That way, when
+ * a job has an operation timeout (op_timeout), a stat/chmod/directory read that hangs (eg. a dead
+ * network mount) only costs the thread stuck in it; the watchdog abandons what it was looking at,
+ * and starts a new thread that picks the walk up where it was.
+ */
+struct walk_frame {
+    struct dir_reader reader;				// the directory being read (reader.fd is what everything in it is
+											// found from); its buffer stays with the frame, for the next one
+    long entries;							// count of entries, when estimating
+    unsigned long long local;				// when fingerprinting, the hashes of its entries, and of its
+    unsigned long long children;			// subdirectories' subtrees, added up (so their order doesn't matter)
+    struct rper_policy *policy;				// the policy for what's in it (a reference), or NULL
+    int overlay;							// with overlay, whether it's in the overlay's upper layer (OVERLAY_*)
+    int upper_fd;							// and if so, that directory there, open (O_PATH)
+    struct verify_change {					// with verify, the changes made in it, read back once it's done
+        size_t name;						// where its name is, in verify_names
+        mode_t mode;						// the permissions it was given
+    } *verify;
+    int nverify;
+    int verify_next;						// the next to be read back
+    int verify_size;
+    char *verify_names;						// their names, one after another (kept for reuse, like the reader's buffer)
+    size_t verify_used;
+    size_t verify_names_size;
+    char name[NAME_MAX + 1];				// its name (the walk's root has none; see root)
+};
+
+/*
+ * What a thread the watchdog gave up on was using, handed over to it with the operation, while the walk
+ * carries on from copies (see abandon_operation); it frees them, if it ever wakes up (see op_end)
+ */
+struct stuck_thread {
+    pthread_t thread;
+    struct dir_reader reader;				// the directory it was reading (left open for it), or only the buffer
+											// the name it was working on is in (fd -1; the directory is the walk's)
+    char *verify_names;						// the names of the changes to read back, if it was reading one back
+    struct stuck_thread *next;
+};
+
+struct rper_walk {
+    struct walk_frame *frames;				// directories part way through, the one being read on top;
+											// each is in the one below it, so a frame's index is its depth
+    int nframes;
+    int capacity;							// frames allocated; those past nframes are kept for their buffers
+    int stage;								// how far the start of the walk has got; see walk()
+    const char *root;						// where the walk starts
+    int root_files;							// the root itself is changed if it's a file and this is set
+    int root_dirs;							// or if it's a directory and this is set
+    int root_is_dir;						// the root is gone into if it's a directory
+    int descend;							// and if this is set
+    void (*walker)(struct rper_job *job);	// the walk's variant for the job's settings; see select_walk
+    dev_t overlay_dev;						// with overlay, the device of the overlay mount the walk started on
+    char path[PATH_MAX];					// where a path is put together, when one is asked for
+
+    /* the watchdog; only used with an operation timeout */
+    pthread_mutex_t lock;
+    pthread_cond_t finished_walk;			// signalled when the walk is done
+    pthread_t worker;						// the thread doing the walk; any other is stuck, and has been abandoned
+    int done;								// the walk is done
+    int finished;							// the job is done with this walk; the last stuck thread frees it
+    int stuck;								// threads abandoned, still stuck in an operation
+    struct stuck_thread *stuck_threads;		// and what each of them was using
+    int busy;								// the worker is in an operation
+    int reading;							// that operation is reading the directory on top of the stack
+    int abandoned;							// the operation was given up on; the next worker reports it first
+    const char *op;							// what the operation is, for the error message
+    struct rper_entry op_entry;				// and what it is on
+    char op_path[PATH_MAX];					// its path, if it's given up on
+    struct timespec op_started;
+};
+
+/*
+ * This function puts together the full path of an entry; only ever done for output, not to find it.
+ * Returns the path, in the given buffer.
+ */
+char *entry_path(const struct rper_entry *entry, char *buffer, size_t size) {
+    const struct rper_walk *walk = entry->walk;
+    if (!walk || entry->parent < 0) {
+        snprintf(buffer, size, "%s", entry->name);	// where the walk started is found by its path
+        return buffer;
+    }
+    size_t len = snprintf(buffer, size, "%s", walk->root);
+    for (int i = 1; i <= entry->parent && len < size; i++) {
+        len += snprintf(buffer + len, size - len, "/%s", walk->frames[i].name);
+    }
+    if (len < size) {
+        snprintf(buffer + len, size - len, "/%s", entry->name);
+    }
+    return buffer;
+}
+
+/*
+ * This function returns the full path of the entry an event is about, put together now it's wanted;
+ * it stays valid until the callback returns
+ */
+const char *rper_event_path(const struct rper_event *event) {
+    struct rper_walk *walk = event->entry->walk;
+    if (!walk || event->entry->parent < 0) {
+        return event->entry->name;
+    }
+    return entry_path(event->entry, walk->path, sizeof(walk->path));
+}
+
+/*
+ * This function describes a directory on the walk's stack as an entry, ie. from the one it is in
+ */
+void frame_entry(struct rper_walk *walk, int index, struct rper_entry *entry) {
+    entry->walk = walk;
+    entry->parent = index - 1;
+    entry->dirfd = index > 0 ? walk->frames[index - 1].reader.fd : AT_FDCWD;
+    entry->name = index > 0 ? walk->frames[index].name : walk->root;
+}
+
+/*
+ * This function marks the start of an operation that could hang, so the watchdog can keep an eye on it.
+ * Returns the walk to hand to op_end, or NULL if the job has no operation timeout.
+ */
+struct rper_walk *op_begin(struct rper_job *job, const char *op, const struct rper_entry *entry, int reading) {
+    struct rper_walk *walk = job->walk;
+    if (job->op_timeout <= 0 || !walk) {
+        return NULL;
+    }
+    pthread_mutex_lock(&walk->lock);
+    walk->busy = 1;
+    walk->reading = reading;
+    walk->op = op;
+    walk->op_entry = *entry;					// no path yet; that is only needed if it hangs
+    clock_gettime(CLOCK_MONOTONIC, &walk->op_started);
+    pthread_mutex_unlock(&walk->lock);
+    return walk;
+}
+
+/*
+ * This function frees a walk, with its frames and their buffers
+ */
+void walk_free(struct rper_walk *walk) {
+    for (int i = 0; i < walk->capacity; i++) {
+        dir_reader_free(&walk->frames[i].reader);
+        free(walk->frames[i].verify);
+        free(walk->frames[i].verify_names);
+    }
+    free(walk->frames);
+    pthread_mutex_destroy(&walk->lock);
+    pthread_cond_destroy(&walk->finished_walk);
+    free(walk);
+}
+
+/*
+ * This function takes a stuck thread's record (see stuck_thread) off the walk's list; the walk's lock is held.
+ * Returns it, or NULL if there was none (no memory for one when it was abandoned).
+ */
+struct stuck_thread *stuck_thread_take(struct rper_walk *walk, pthread_t thread) {
+    for (struct stuck_thread **stuck = &walk->stuck_threads; *stuck; stuck = &(*stuck)->next) {
+        if (pthread_equal((*stuck)->thread, thread)) {
+            struct stuck_thread *found = *stuck;
+            *stuck = found->next;
+            return found;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * This function frees what a stuck thread was left with, now it's done with it
+ */
+void stuck_thread_free(struct stuck_thread *stuck) {
+    if (!stuck) {
+        return;
+    }
+    if (stuck->reader.fd >= 0) {
+        dir_close(&stuck->reader);
+    }
+    dir_reader_free(&stuck->reader);
+    free(stuck->verify_names);
+    free(stuck);
+}
+
+/*
+ * This function marks the end of an operation. A thread the watchdog has given up on goes no further;
+ * it has been replaced, so it frees what it was left with and leaves, without touching the job (which may
+ * be long gone). If the operation opened a directory (opened), that is closed too; nobody else will.
+ */
+void op_end_opened(struct rper_walk *walk, struct dir_reader *opened) {
+    if (!walk) {
+        return;
+    }
+    int saved_errno = errno;					// the operation's errno is still wanted
+    pthread_mutex_lock(&walk->lock);
+    if (!pthread_equal(pthread_self(), walk->worker)) {
+        struct stuck_thread *stuck = stuck_thread_take(walk, pthread_self());
+        int last = --walk->stuck == 0 && walk->finished;
+        pthread_mutex_unlock(&walk->lock);
+        stuck_thread_free(stuck);
+        if (opened) {
+            dir_close(opened);					// its buffer is the frame's; see meta_opendir
+        }
+        if (last) {
+            walk_free(walk);					// its frames are already gone
+        }
+        pthread_exit(NULL);
+    }
+    walk->busy = 0;
+    pthread_mutex_unlock(&walk->lock);
+    errno = saved_errno;
+}
+
+void op_end(struct rper_walk *walk) {
+    op_end_opened(walk, NULL);
+}
+
+/*
+ * Overlay filesystems. Changing anything that is only in a lower layer copies it up into the upper layer first,
+ * data and all, so a recursive change over an image's files can copy gigabytes. With overlay set, rper follows
+ * the upper layer along with the walk (the same directory there, for each directory walked, while there is one),
+ * so an entry is known to be in a lower layer only (nothing by its name in the upper layer) before it's changed.
+ */
+#define OVERLAYFS_SUPER_MAGIC 0x794c7630
+enum { OVERLAY_NONE, OVERLAY_UPPER, OVERLAY_LOWER_ONLY };	// walk_frame.overlay
+
+#ifdef __linux__
+/*
+ * This function undoes the mount table's escapes (eg. "\040" for a space), in place
+ */
+static void overlay_unescape(char *s) {
+    char *out = s;
+    for (; *s; s++) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *out++ = (s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0');
+            s += 3;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+/*
+ * This function finds where the directory open as fd is in the upper layer of the overlay mount it is on, from
+ * the mount table. The mount can be of a directory inside the overlay (a bind mount of it, eg. into a container),
+ * so its path there is the mount's root, then the path below the mount point. Returns 0 with that path in the upper
+ * layer in upper (the first upper_len bytes of which are the upper layer itself), or -1 (errno says why; ENOENT
+ * if the mount has no upper layer)
+ */
+int overlay_upper_path(int fd, char *upper, size_t size, size_t *upper_len) {
+    char link[64], path[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, path, sizeof(path) - 1);
+    if (len < 0) {
+        return -1;
+    }
+    path[len] = '\0';
+
+    FILE *mounts = fopen("/proc/self/mountinfo", "r");
+    if (!mounts) {
+        return -1;
+    }
+    // The mount it's on is the one with the longest mount point the path starts with (the last, if mounted over)
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t best = 0;
+    int found = 0;
+    char upperdir[PATH_MAX] = "";
+    char root[PATH_MAX] = "";
+    while (getline(&line, &line_size, mounts) != -1) {
+        // id parent major:minor root mount-point options [optional fields...] - type source super-options
+        char *fields[5], *save;
+        char *field = strtok_r(line, " ", &save);
+        for (int i = 0; i < 5 && field; i++, field = strtok_r(NULL, " ", &save)) {
+            fields[i] = field;
+        }
+        while (field && strcmp(field, "-") != 0) {
+            field = strtok_r(NULL, " ", &save);
+        }
+        char *type = field ? strtok_r(NULL, " ", &save) : NULL;
+        char *source = type ? strtok_r(NULL, " ", &save) : NULL;
+        char *options = source ? strtok_r(NULL, " \n", &save) : NULL;
+        if (!options) {
+            continue;
+        }
+        char *mount_point = fields[4];
+        overlay_unescape(mount_point);
+        size_t mp_len = strcmp(mount_point, "/") == 0 ? 0 : strlen(mount_point);
+        if (strncmp(path, mount_point, mp_len) != 0 || (path[mp_len] != '/' && path[mp_len] != '\0') || mp_len < best) {
+            continue;
+        }
+        best = mp_len;
+        found = strcmp(type, "overlay") == 0;
+        upperdir[0] = '\0';
+        overlay_unescape(fields[3]);
+        snprintf(root, sizeof(root), "%s", strcmp(fields[3], "/") == 0 ? "" : fields[3]);	// "/" for the whole overlay
+        for (char *option = strtok_r(options, ",", &save); option; option = strtok_r(NULL, ",", &save)) {
+            if (strncmp(option, "upperdir=", 9) == 0 && strlen(option + 9) < sizeof(upperdir)) {
+                strcpy(upperdir, option + 9);
+                overlay_unescape(upperdir);
+            }
+        }
+    }
+    free(line);
+    fclose(mounts);
+
+    if (!found || !upperdir[0]) {
+        errno = found ? ENOENT : EINVAL;		// read-only (lower layers only); or not an overlay after all
+        return -1;
+    }
+    if ((size_t)snprintf(upper, size, "%s%s%s", upperdir, root, path + best) >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    *upper_len = strlen(upperdir);
+    return 0;
+}
+#endif
+
+/*
+ * This function tells whether a path is on an overlay filesystem; one statfs
+ */
+int overlay_is_on(const char *path) {
+#ifdef __linux__
+    struct statfs fs;
+    return statfs(path, &fs) == 0 && fs.f_type == OVERLAYFS_SUPER_MAGIC;
+#else
+    (void)path;
+    return 0;
+#endif
+}
+
+/*
+ * This function finds a directory that has just been opened in the overlay's upper layer. Where the walk starts,
+ * that's only if it's on an overlay mount; further down, only if the directory it's in was found there, and it's on
+ * the same mount. Returns its state (walk_frame.overlay), with upper_fd set for OVERLAY_UPPER; or -1 if it can't be
+ * found (errno says why; eg. the upper layer can't be looked at without root). The overlay's device is set in dev where the walk starts,
+ * and checked against it below. Off the overlay, that's all it costs: nothing at all below a directory that isn't on one.
+ */
+int overlay_find(int dir_fd, int parent_state, int parent_upper_fd, const char *name, dev_t *dev, int *upper_fd) {
+#ifdef __linux__
+    if (parent_state == OVERLAY_NONE) {
+        return OVERLAY_NONE;					// nothing below a directory off the overlay is on it
+    }
+    struct stat statbuf;
+    if (fstat(dir_fd, &statbuf) != 0) {
+        return -1;
+    }
+    if (parent_state < 0) {
+        // Where the walk starts
+        struct statfs fs;
+        if (fstatfs(dir_fd, &fs) != 0 || fs.f_type != OVERLAYFS_SUPER_MAGIC) {
+            return OVERLAY_NONE;
+        }
+        *dev = statbuf.st_dev;					// an overlay's directories all have its device
+        char upper[PATH_MAX];
+        size_t upper_len;
+        if (overlay_upper_path(dir_fd, upper, sizeof(upper), &upper_len) != 0) {
+            return errno == ENOENT ? OVERLAY_LOWER_ONLY : -1;
+        }
+        *upper_fd = open(upper, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (*upper_fd < 0 && (errno == ENOENT || errno == ENOTDIR)) {
+            // Only lower-only if the upper layer itself is there to look in. The mount table gives its path as the
+            // mount saw it; inside a container that's usually a host path, which isn't there at all
+            upper[upper_len] = '\0';
+            int layer_fd = open(upper, O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if (layer_fd < 0) {
+                return -1;
+            }
+            close(layer_fd);
+            errno = ENOENT;
+        }
+    } else {
+        if (statbuf.st_dev != *dev) {
+            return OVERLAY_NONE;				// not on the overlay (eg. something mounted inside it)
+        }
+        if (parent_state == OVERLAY_LOWER_ONLY) {
+            return OVERLAY_LOWER_ONLY;			// nor is anything in it
+        }
+        *upper_fd = openat(parent_upper_fd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (*upper_fd >= 0) {
+        return OVERLAY_UPPER;
+    }
+    return errno == ENOENT || errno == ENOTDIR ? OVERLAY_LOWER_ONLY : -1;
+#else
+    (void)dir_fd; (void)parent_state; (void)parent_upper_fd; (void)name; (void)dev; (void)upper_fd;
+    return OVERLAY_NONE;						// overlayfs is Linux only
+#endif
+}
+
+/*
+ * The metadata syscalls rper makes all go through these, so latency can be injected,
+ * the job's throttle applied, and the watchdog kept informed, in one place.
+ * Entries are found from the directory they are in (dirfd), so no full path is ever needed.
+ */
+int meta_lstat(struct rper_job *job, const struct rper_entry *entry, struct stat *statbuf) {
+    if (job->throttle) throttle_wait(job->throttle);
+    struct timespec start;
+    metrics_op_start(job, &start);
+    struct rper_walk *walk = op_begin(job, "access(stat) file", entry, 0);
+    inject_latency();
+    int result = fstatat(entry->dirfd, entry->name, statbuf, AT_SYMLINK_NOFOLLOW);
+    op_end(walk);
+    metrics_op_done(job, &start);
+    return result;
+}
+
+int meta_chmod(struct rper_job *job, const struct rper_entry *entry, mode_t mode) {
+    if (job->throttle) throttle_wait(job->throttle);
+    struct timespec start;
+    metrics_op_start(job, &start);
+    struct rper_walk *walk = op_begin(job, "change permissions", entry, 0);
+    inject_latency();
+    int result = fchmodat(entry->dirfd, entry->name, mode, 0);
+    op_end(walk);
+    metrics_op_done(job, &start);
+    return result;
+}
+
+/*
+ * Reading permissions back (see verify). On Linux, statx with AT_STATX_FORCE_SYNC makes network filesystems
+ * ask the server, rather than answer from what they have cached; elsewhere it's a plain stat.
+ */
+int meta_verify(struct rper_job *job, const struct rper_entry *entry, mode_t *mode) {
+    if (job->throttle) throttle_wait(job->throttle);
+    struct timespec start;
+    metrics_op_start(job, &start);
+    struct rper_walk *walk = op_begin(job, "verify permissions", entry, 0);
+    inject_latency();
+#if defined(__linux__) && defined(STATX_MODE) && defined(AT_STATX_FORCE_SYNC)
+    struct statx statxbuf;
+    int result = statx(entry->dirfd, entry->name, AT_SYMLINK_NOFOLLOW | AT_STATX_FORCE_SYNC, STATX_MODE, &statxbuf);
+    mode_t found = result == 0 ? statxbuf.stx_mode : 0;
+#else
+    struct stat statbuf;
+    int result = fstatat(entry->dirfd, entry->name, &statbuf, AT_SYMLINK_NOFOLLOW);
+    mode_t found = result == 0 ? statbuf.st_mode : 0;
+#endif
+    op_end(walk);
+    metrics_op_done(job, &start);
+    if (result == 0) {
+        *mode = found & 0777;				// the permissions, as rper sees them (last 3 digits)
+    }
+    return result;
+}
+
+/*
+ * Directories are opened and read using a copy of the frame's reader, only put back once the
+ * operation is over; a thread stuck part way through (and abandoned) never touches the frame again,
+ * which by then may well be reading some other directory
+ */
+int meta_opendir(struct rper_job *job, const struct rper_entry *entry, int index) {
+    if (job->throttle) throttle_wait(job->throttle);
+    if (dir_reader_init(&job->walk->frames[index].reader) != 0) {
+        return -1;								// the buffer is the frame's before the copy, so all the copy opens is the fd
+    }
+    struct dir_reader reader = job->walk->frames[index].reader;
+    struct timespec start;
+    metrics_op_start(job, &start);
+    struct rper_walk *walk = op_begin(job, "open directory", entry, 0);
+    inject_latency();
+    int result = dir_open(&reader, entry->dirfd, entry->name);
+    op_end_opened(walk, result == 0 ? &reader : NULL);
+    metrics_op_done(job, &start);
+    job->walk->frames[index].reader = reader;
+    return result;
+}
+
+dir_entry *meta_readdir(struct rper_job *job, int index) {
+    struct rper_walk *walk = job->walk;
+    struct dir_reader reader = walk->frames[index].reader;
+    struct rper_entry entry;
+    if (job->op_timeout > 0) {
+        frame_entry(walk, index, &entry);
+    }
+    struct rper_walk *watched = op_begin(job, "read directory", &entry, 1);
+    if (dir_read_pending(&reader)) {
+        inject_latency();						// this one goes to the filesystem (getdents64)
+    }
+    dir_entry *dirent = dir_read(&reader);
+    op_end(watched);
+    walk->frames[index].reader = reader;
+    return dirent;
+}
+
+int meta_load_policy(struct rper_job *job, const struct rper_entry *entry, struct rper_policy *parent,
+                     struct rper_policy **policy) {
+    if (job->throttle) throttle_wait(job->throttle);
+    struct rper_walk *walk = op_begin(job, "read policy", entry, 0);
+    struct rper_policy *loaded;
+    int result = policy_load(entry->dirfd, parent, &loaded);
+    op_end(walk);
+    *policy = loaded;
+    return result;
+}
+
+/*
+ * The overlay's upper layer is followed the same way (see overlay_find); found into locals,
+ * and only put in the frame once the operation is over. Returns 0, or -1 if it couldn't be found (errno says why)
+ */
+int meta_overlay_enter(struct rper_job *job, const struct rper_entry *entry, int index) {
+    struct rper_walk *walk = job->walk;
+    int parent_state = index > 0 ? walk->frames[index - 1].overlay : -1;
+    int parent_upper_fd = index > 0 ? walk->frames[index - 1].upper_fd : -1;
+    int dir_fd = walk->frames[index].reader.fd;
+    dev_t dev = walk->overlay_dev;
+    int upper_fd = -1;
+    if (parent_state == OVERLAY_NONE) {
+        walk->frames[index].overlay = OVERLAY_NONE;	// no syscall to make, so no throttle either
+        return 0;
+    }
+    if (job->throttle) throttle_wait(job->throttle);
+    struct rper_walk *watched = op_begin(job, "find overlay upper layer", entry, 0);
+    int state = overlay_find(dir_fd, parent_state, parent_upper_fd, entry->name, &dev, &upper_fd);
+    op_end(watched);
+    walk->overlay_dev = dev;
+    walk->frames[index].upper_fd = upper_fd;
+    walk->frames[index].overlay = state < 0 ? OVERLAY_LOWER_ONLY : state;	// if in doubt, the worst case
+    return state < 0 ? -1 : 0;
+}
+
+/*
+ * This function looks for an entry in the overlay's upper layer. Returns 1 if it isn't there (it's only in a lower layer),
+ * 0 if it is, or -1 if the upper layer couldn't be looked in (errno says why)
+ */
+int meta_overlay_lower_only(struct rper_job *job, const struct rper_entry *entry, int upper_fd) {
+    struct stat statbuf;
+    if (job->throttle) throttle_wait(job->throttle);
+    struct rper_walk *walk = op_begin(job, "find overlay upper layer", entry, 0);
+    int result = fstatat(upper_fd, entry->name, &statbuf, AT_SYMLINK_NOFOLLOW);
+    op_end(walk);
+    if (result == 0) {
+        return 0;
+    }
+    return errno == ENOENT ? 1 : -1;
+}
+
+void meta_closedir(struct rper_job *job, struct dir_reader *reader, const struct rper_entry *entry) {
+    struct rper_walk *walk = op_begin(job, "close directory", entry, 0);
+    dir_close(reader);
+    op_end(walk);
+}
+
+/*
+ * The prefetch's (see prefetch). Its threads aren't the walk's, so the watchdog doesn't look after them (op_end
+ * would take them for stuck ones); nor does it need to, as nothing waits on them. A prefetch thread stuck on a hung
+ * mount only holds up itself; the walk gets to the same directory on its own, and that is watched. A throttle
+ * turns the prefetch off, so there's none to apply either; it's only the latency that is injected here.
+ */
+int meta_prefetch_opendir(struct dir_reader *reader, const char *path) {
+    inject_latency();
+    return dir_open(reader, AT_FDCWD, path);
+}
+
+dir_entry *meta_prefetch_readdir(struct dir_reader *reader) {
+    if (dir_read_pending(reader)) {
+        inject_latency();
+    }
+    return dir_read(reader);
+}
+
+int meta_prefetch_lstat(int dirfd, const char *name, struct stat *statbuf) {
+    inject_latency();
+    return fstatat(dirfd, name, statbuf, AT_SYMLINK_NOFOLLOW);
+}
+
+/* Library functions (librper) */
+/*
+ * This function sets up a job with the defaults; recursive, nothing selected, no callback.
+ * The caller still needs to give it a mode (rper_compile_mode) and select files and/or directories.
+ */
+void rper_job_init(struct rper_job *job) {
+    memset(job, 0, sizeof(*job));				// every count, flag and pointer starts at zero
+    job->recursive = 1;							// process directories recursively by default
+    job->mode.keep = 0777;						// an empty mode changes nothing
+}
+
+/*
+ * This function validates the octal mode given (e.g., '755', '0644' or '6*4'), and compiles it
+ * into the bits to keep and the bits to set, so it doesn't need to be looked at again for each entry.
+ * Returns 0 on success, -1 if the mode is invalid.
+ */
+int rper_compile_mode(const char *spec, struct rper_mode *mode) {
+    size_t len = strlen(spec);
+
+    // Remove leading zero if present and length is 4
+    if (len == 4 && spec[0] == '0') {
+        spec++;  // Skip the first character
+        len--;
+    }
+
+    // Check if the length is exactly 3 and contains only valid octal digits or wildcard (*)
+    if (len != 3 || strspn(spec, "4567*") != 3) {
+        return -1;
+    }
+
+	// Iterate through each part (user, group, others)
+    mode->keep = 0;
+    mode->set = 0;
+    for (int i = 0; i < 3; i++) {
+        int shift = 6 - 3 * i;					// user is the left-most 3 bits, others the right-most
+        if (spec[i] == '*') {
+            mode->keep |= 7 << shift;			// the wildcard '*' means this part is not changed
+        } else {
+            mode->set |= (spec[i] - '0') << shift;	// otherwise these are the new bits
+        }
+    }
+    memcpy(mode->spec, spec, 3);				// kept for output, eg. 6*4
+    mode->spec[3] = '\0';
+    return 0;
+}
+
+/*
+ * This function applies the compiled mode (e.g., '6*4') to the current permissions.
+ * The parts given as a wildcard '*' are kept, the rest are replaced.
+ */
+mode_t apply_wildcard_mode(const struct rper_mode *mode, mode_t old_mode) {
+    return ((old_mode & 0777) & mode->keep) | mode->set;	// Return the new permission mode
+}
+
+/*
+ * This function hands an event to the job's callback, if it has one
+ */
+void report_event(struct rper_job *job, const struct rper_event *event) {
+    if (event->type == RPER_ERROR) {
+        job->errors++;							// errors are counted, even if nobody is listening
+        if (job->metrics) {
+            METRIC_ADD(job->metrics, errors, 1);
+        }
+    }
+    if (job->on_event) {
+        job->on_event(job, event, job->user);
+    }
+}
+
+/*
+ * This function reports an error for the given entry; what failed and the errno value
+ */
+void report_error(struct rper_job *job, const struct rper_entry *entry, const char *failed, int error) {
+    struct rper_event event = {0};
+    event.type = RPER_ERROR;
+    event.entry = entry;
+    event.failed = failed;
+    event.error = error;
+    report_event(job, &event);
+}
+
+/*
+ * This function adds a top-level subtree to the histogram; returns its index, or 0 (".") if out of memory
+ */
+int histogram_subtree(struct rper_histogram *histogram, const char *name) {
+    if (histogram->nsubtrees == histogram->capacity) {
+        int capacity = histogram->capacity * 2 + 16;
+        struct rper_subtree_counts *subtrees = realloc(histogram->subtrees, capacity * sizeof(*subtrees));
+        if (!subtrees) {
+            return 0;
+        }
+        histogram->subtrees = subtrees;
+        histogram->capacity = capacity;
+    }
+    struct rper_subtree_counts *subtree = &histogram->subtrees[histogram->nsubtrees];
+    subtree->name = strdup(name);
+    subtree->counts = calloc(1, sizeof(*subtree->counts));
+    if (!subtree->name || !subtree->counts) {
+        free(subtree->name);
+        free(subtree->counts);
+        return 0;
+    }
+    return histogram->nsubtrees++;
+}
+
+/*
+ * This function counts the permissions of a file/directory, overall and in the current top-level subtree
+ */
+void histogram_count(struct rper_job *job, int is_dir, mode_t mode) {
+    struct rper_histogram *histogram = job->histogram;
+    long *total = is_dir ? histogram->total.dirs : histogram->total.files;
+    total[mode & 0777]++;
+    if (job->subtree < histogram->nsubtrees) {
+        struct rper_mode_counts *counts = histogram->subtrees[job->subtree].counts;
+        (is_dir ? counts->dirs : counts->files)[mode & 0777]++;
+    }
+}
+
+/*
+ * This function frees what a histogram has allocated
+ */
+void rper_histogram_free(struct rper_histogram *histogram) {
+    for (int i = 0; i < histogram->nsubtrees; i++) {
+        free(histogram->subtrees[i].name);
+        free(histogram->subtrees[i].counts);
+    }
+    free(histogram->subtrees);
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+/*
+ * This function decides whether a file/directory is part of the sample (job->sample_rate);
+ * each entry of the selected types gets the same chance, independent of every other entry.
+ * Returns 1 if it should be looked at, otherwise 0.
+ */
+int sample_entry(struct rper_job *job, int is_dir) {
+    if (!(is_dir ? job->change_dirs : job->change_files)) {
+        return 0;								// only the types being changed are part of the sample
+    }
+    job->entries_seen++;
+
+    // xorshift64*; small, fast, and plenty random enough for picking entries
+    unsigned long long x = job->sample_seed ? job->sample_seed : 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    job->sample_seed = x;
+    double draw = ((x * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;	// 0 to 1, from the top 53 bits
+
+    if (draw >= job->sample_rate) {
+        return 0;
+    }
+    job->entries_sampled++;
+    return 1;
+}
+
+/*
+ * This function counts an entry when estimating. The type comes from readdir (d_type) where it can,
+ * and every so often a stat is made anyway, and timed, to find what a stat costs on this filesystem.
+ * Returns 1 if the entry is a directory, otherwise 0.
+ */
+#define ESTIMATE_TIME_FIRST 64					// the first entries are all timed
+#define ESTIMATE_TIME_EVERY 256					// after that, one in this many
+
+int estimate_entry(struct rper_job *job, const struct rper_entry *entry, unsigned char d_type) {
+    struct rper_estimate *estimate = job->estimate;
+    estimate->entries++;
+
+    int timed = estimate->entries <= ESTIMATE_TIME_FIRST || estimate->entries % ESTIMATE_TIME_EVERY == 0;
+    if (timed || d_type == DT_UNKNOWN) {
+        struct stat statbuf;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int found = meta_lstat(job, entry, &statbuf) == 0;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        estimate->stats_timed++;
+        estimate->stat_seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (found && d_type == DT_UNKNOWN) {
+            d_type = IFTODT(statbuf.st_mode);	// the filesystem couldn't tell us, the stat could
+        }
+    }
+
+    if (d_type == DT_DIR) {
+        estimate->dirs++;
+    } else if (d_type == DT_REG) {
+        estimate->files++;
+    }
+    return d_type == DT_DIR;
+}
+
+/*
+ * This function records a directory's size and depth once it has been read, when estimating;
+ * keeping the largest directories in order, largest first
+ */
+void estimate_directory(struct rper_job *job, const struct rper_entry *dir, long entries, int depth) {
+    struct rper_estimate *estimate = job->estimate;
+    if (depth > estimate->max_depth) {
+        estimate->max_depth = depth;
+    }
+
+    int i = estimate->nlargest;
+    if (i == RPER_LARGEST_DIRS) {
+        if (entries <= estimate->largest[i - 1].entries) {
+            return;								// not one of the largest
+        }
+        i--;									// the smallest makes way
+    } else {
+        estimate->nlargest++;
+    }
+    // Move the smaller ones down, to make room
+    for (; i > 0 && estimate->largest[i - 1].entries < entries; i--) {
+        estimate->largest[i] = estimate->largest[i - 1];
+    }
+    estimate->largest[i].entries = entries;
+    entry_path(dir, estimate->largest[i].path, sizeof(estimate->largest[i].path));
+}
+
+/*
+ * Fingerprints. Each entry is hashed from its name, type and permissions, and the hashes are added up per directory,
+ * which makes them the same whatever order the directory lists them in. A directory's subtree hash covers that sum
+ * and, added up the same way, the subtree hashes of its subdirectories, each together with its name; so the
+ * fingerprints of two trees differ exactly in the directories on the way to where the trees differ.
+ */
+static unsigned long long fingerprint_mix(unsigned long long x) {
+    x ^= x >> 30;								// the splitmix64 finalizer
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static unsigned long long fingerprint_name(const char *name) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;	// FNV-1a
+    for (; *name; name++) {
+        hash = (hash ^ (unsigned char)*name) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * This function adds an entry to the fingerprint of the directory it is in.
+ * Returns 1 if the entry is a directory, otherwise 0.
+ */
+int fingerprint_entry(struct rper_job *job, const struct rper_entry *entry) {
+    struct stat statbuf;
+    if (meta_lstat(job, entry, &statbuf) != 0) {
+        report_error(job, entry, "access(stat) file", errno);
+        return 0;
+    }
+    // A symlink's permissions mean nothing (and differ between systems), so only its name and type count
+    unsigned long long type = IFTODT(statbuf.st_mode);
+    unsigned long long mode = S_ISLNK(statbuf.st_mode) ? 0 : statbuf.st_mode & 07777;
+    job->walk->frames[entry->parent].local += fingerprint_mix(fingerprint_name(entry->name) ^ (type << 12 | mode));
+    return S_ISDIR(statbuf.st_mode);
+}
+
+/*
+ * This function writes a directory's fingerprint once it has all been read, and adds its subtree hash to the one it is in
+ */
+void fingerprint_directory(struct rper_job *job, int depth) {
+    struct rper_walk *walk = job->walk;
+    struct walk_frame *frame = &walk->frames[depth];
+    unsigned long long subtree = fingerprint_mix(frame->local + fingerprint_mix(frame->children + 1));
+
+    FILE *out = job->fingerprint->out;
+    fprintf(out, "%016llx %016llx .", subtree, frame->local);
+    for (int i = 1; i <= depth; i++) {
+        fputc('/', out);
+        for (const char *c = walk->frames[i].name; *c; c++) {
+            if (*c == '\\' || *c == '\n') {
+                fputc('\\', out);				// one line per directory, whatever the names
+            }
+            fputc(*c == '\n' ? 'n' : *c, out);
+        }
+    }
+    fputc('\n', out);
+
+    job->fingerprint->dirs++;
+    if (depth > 0) {
+        walk->frames[depth - 1].children += fingerprint_mix(fingerprint_name(frame->name) + subtree);
+    } else {
+        job->fingerprint->root = subtree;
+    }
+}
+
+/*
+ * This function decides, just before an entry is changed, whether changing it is allowed to copy it up from a lower
+ * layer (always, if it's in the upper layer already, or not on an overlay at all); and counts the copy-ups.
+ * Returns 1 if it can be changed, 0 if it has to be left alone.
+ */
+int overlay_allows(struct rper_job *job, const struct rper_entry *entry, const struct stat *statbuf) {
+    if (entry->parent < 0) {
+        return 1;								// where the walk starts; the upper layer is only followed below it
+    }
+    const struct walk_frame *frame = &entry->walk->frames[entry->parent];
+    if (frame->overlay == OVERLAY_NONE) {
+        return 1;
+    }
+    if (frame->overlay == OVERLAY_UPPER) {
+        int lower_only = meta_overlay_lower_only(job, entry, frame->upper_fd);
+        if (lower_only == 0) {
+            return 1;
+        }
+        if (lower_only < 0) {
+            // Not known to be in the upper layer (eg. EACCES, EIO), so taken to be lower-only, the worst case;
+            // the same as a directory whose upper layer can't be found (see meta_overlay_enter)
+            report_error(job, entry, "find overlay upper layer", errno);
+        }
+    }
+
+    // A file's copy-up copies its data; a directory's, only the directory (what's in it stays where it is)
+    unsigned long long bytes = S_ISREG(statbuf->st_mode) ? (unsigned long long)statbuf->st_size : 0;
+    if (job->overlay == RPER_OVERLAY_SKIP ||
+            (job->overlay == RPER_OVERLAY_CAP && job->copy_up_bytes + bytes > job->overlay_cap)) {
+        job->copy_ups_avoided++;
+        return 0;
+    }
+    job->copy_ups++;
+    job->copy_up_bytes += bytes;
+    return 1;
+}
+
+/*
+ * Verifying. Some filesystems (network ones, FUSE) can take a chmod, then put the bits back, or map them to others.
+ * With verify, each change is noted in the frame of the directory it is in, and once that directory is done they
+ * are read back together; with a stat that asks the server, rather than the cache, where there is one. By then
+ * the server has had a moment to settle, and verifying costs about one metadata read per change.
+ */
+#define VERIFY_NAMES_MIN 4096					// a frame's first allocation for names, doubled as needed
+#define VERIFY_MIN 64							// and for changes
+
+/*
+ * This function reads an entry's permissions back, and adds it to the job's mismatches if they aren't what was set
+ */
+void verify_entry(struct rper_job *job, const struct rper_entry *entry, mode_t expected) {
+    mode_t found;
+    if (meta_verify(job, entry, &found) != 0) {
+        if (errno != ENOENT) {					// gone since, which is no fault of the change
+            report_error(job, entry, "verify permissions", errno);
+        }
+        return;
+    }
+    job->verified++;
+    if (found == expected) {
+        return;
+    }
+
+    char path[PATH_MAX];
+    struct rper_mismatch *mismatches = realloc(job->mismatches, (job->nmismatches + 1) * sizeof(*mismatches));
+    if (mismatches) {
+        job->mismatches = mismatches;
+    }
+    if (!mismatches || !(mismatches[job->nmismatches].path = strdup(entry_path(entry, path, sizeof(path))))) {
+        report_error(job, entry, "verify permissions", ENOMEM);
+        return;
+    }
+    mismatches[job->nmismatches].expected = expected;
+    mismatches[job->nmismatches].found = found;
+    job->nmismatches++;
+}
+
+/*
+ * This function notes a change, to be verified once the directory it is in is done. The frame's
+ * buffers are kept for the next directory, so once they are big enough, nothing is allocated.
+ */
+void verify_add(struct rper_job *job, const struct rper_entry *entry, mode_t mode) {
+    if (entry->parent < 0) {
+        verify_entry(job, entry, mode);			// where the walk starts isn't in any directory of the walk's
+        return;
+    }
+    struct walk_frame *frame = &entry->walk->frames[entry->parent];
+    size_t len = strlen(entry->name) + 1;
+    if (frame->verify_used + len > frame->verify_names_size) {
+        size_t size = frame->verify_names_size ? frame->verify_names_size * 2 : VERIFY_NAMES_MIN;
+        while (size < frame->verify_used + len) {
+            size *= 2;
+        }
+        char *names = realloc(frame->verify_names, size);
+        if (!names) {
+            verify_entry(job, entry, mode);		// no room to wait, so it's read back straight away
+            return;
+        }
+        frame->verify_names = names;
+        frame->verify_names_size = size;
+    }
+    if (frame->nverify == frame->verify_size) {
+        int size = frame->verify_size ? frame->verify_size * 2 : VERIFY_MIN;
+        struct verify_change *changes = realloc(frame->verify, size * sizeof(*changes));
+        if (!changes) {
+            verify_entry(job, entry, mode);
+            return;
+        }
+        frame->verify = changes;
+        frame->verify_size = size;
+    }
+    memcpy(frame->verify_names + frame->verify_used, entry->name, len);
+    frame->verify[frame->nverify].name = frame->verify_used;
+    frame->verify[frame->nverify].mode = mode;
+    frame->nverify++;
+    frame->verify_used += len;
+}
+
+/*
+ * This function reads back the changes made in a directory, once it has all been read. The frame keeps its
+ * place (verify_next), so if a read hangs, the thread carrying on with the walk goes on from the one after it.
+ */
+void verify_directory(struct rper_job *job, int depth) {
+    struct walk_frame *frame = &job->walk->frames[depth];
+    struct rper_entry entry = {job->walk, depth, frame->reader.fd, NULL};
+    while (frame->verify_next < frame->nverify) {
+        struct verify_change *change = &frame->verify[frame->verify_next++];
+        entry.name = frame->verify_names + change->name;
+        verify_entry(job, &entry, change->mode);
+    }
+}
+
+/*
+ * This function gives the frame a copy of its names, leaving the old ones to a thread stuck reading one
+ * back (see op_timeout); like dir_reader_unshare. Returns the old ones.
+ */
+char *verify_unshare(struct walk_frame *frame) {
+    char *left = frame->verify_names;
+    char *copy = malloc(frame->verify_names_size);
+    if (copy) {
+        memcpy(copy, frame->verify_names, frame->verify_used);
+    } else {
+        frame->verify_names_size = 0;
+        frame->verify_used = 0;
+        frame->verify_next = frame->nverify = 0;	// the rest are given up on too
+    }
+    frame->verify_names = copy;
+    return left;
+}
+
+/*
+ * This function decides, from the type readdir gives us (d_type), whether an entry
+ * is worth a stat at all. Only files and directories are ever changed or reported,
+ * so anything else (symlinks, sockets, devices, etc.) costs nothing beyond the directory read.
+ * The settings are passed in, rather than read from the job, so the walk's variants can pass constants.
+ * Returns 1 if the entry needs to be looked at by change_permissions, 0 if it can be skipped.
+ */
+static inline __attribute__((always_inline))
+int entry_needs_stat(unsigned char d_type, int change_files, int change_dirs, int report_all, int histogram) {
+    switch (d_type) {
+        case DT_REG:
+            return change_files || report_all || histogram;	// files are only changed with -f, only reported otherwise with -v
+        case DT_DIR:
+            return change_dirs || report_all || histogram;		// same for directories, with -d
+        case DT_UNKNOWN:
+            return 1;							// the filesystem doesn't fill in d_type, so we have to ask
+        default:
+            return 0;							// never changed, never reported
+    }
+}
+
+/*
+ * This function changes the permissions of a given file/directory.
+ * It handles both files and directories and reports the changes made.
+ * It is always inlined, so that in the walk's variants (see WALK_VARIANT) the settings passed in are constants,
+ * and every check on them is decided at compile time; generic is set when the job has to be looked at
+ * for anything else (check, histogram), report when there might be someone to tell (on_event),
+ * and full when the mode has no wildcards, so the new mode is simply mode.set.
+ * Returns 1 if the path turned out to be a directory (needed when readdir can't tell us), otherwise 0.
+ */
+static inline __attribute__((always_inline))
+int change_entry(struct rper_job *job, const struct rper_entry *entry, const struct rper_policy *policy,
+                 int change_files, int change_dirs, int generic, int report, int report_all, int full) {
+    struct stat statbuf;						// Structure to hold information about the file/directory
+    // Get the status of the file/directory (its type, permissions, etc.)
+	if (meta_lstat(job, entry, &statbuf) != 0) {
+        report_error(job, entry, "access(stat) file", errno);
+        return 0;
+    }
+
+    int is_dir = S_ISDIR(statbuf.st_mode);
+    if (!is_dir && !S_ISREG(statbuf.st_mode)) {
+        return 0;								// only files and directories are ever changed
+    }
+
+    int selected = is_dir ? change_dirs : change_files;
+    mode_t old_mode = statbuf.st_mode & 0777;		// Get current permissions (last 3 digits)
+    const struct rper_mode *mode = &job->mode;
+    if (generic && policy) {
+        mode = policy_mode(policy, entry->name, is_dir, mode);	// the policy it comes under decides
+    }
+    mode_t new_mode = full ? mode->set : apply_wildcard_mode(mode, old_mode);	// Apply the wildcard to get the new mode
+    if (generic && job->histogram) {
+        histogram_count(job, is_dir, old_mode);	// the permissions as found
+    }
+
+    // If the new permissions are the same as the old ones, skip this file/directory
+    if (old_mode == new_mode) {
+        if (report && (selected || report_all)) {
+            struct rper_event event = {RPER_SKIPPED, entry, is_dir, selected, old_mode, new_mode, mode, NULL, 0, &statbuf};
+            report_event(job, &event);
+        }
+        return is_dir;
+    }
+    // On an overlay, changing something only in a lower layer copies it up; that may not be allowed
+    if (generic && job->overlay && selected && !overlay_allows(job, entry, &statbuf)) {
+        if (report) {
+            struct rper_event event = {RPER_COPY_UP_AVOIDED, entry, is_dir, selected, old_mode, new_mode, mode, NULL, 0, &statbuf};
+            report_event(job, &event);
+        }
+        return is_dir;
+    }
+	// If it's a type we want to change, change it (or, when only checking, count it as if it had been)
+    if (selected) {
+        if ((generic && job->check) || meta_chmod(job, entry, new_mode) == 0) {
+            if (is_dir) {
+                job->dirs_changed++;			// Increment count of directories changed
+            } else {
+                job->files_changed++;			// Increment count of files changed
+            }
+            if (generic && job->verify && !job->check) {
+                verify_add(job, entry, new_mode);	// read back once the directory it's in is done
+            }
+            if (job->metrics) {
+                if (is_dir) {
+                    METRIC_ADD(job->metrics, dirs_changed, 1);
+                } else {
+                    METRIC_ADD(job->metrics, files_changed, 1);
+                }
+            }
+            if (report) {
+                struct rper_event event = {RPER_CHANGED, entry, is_dir, selected, old_mode, new_mode, mode, NULL, 0, &statbuf};
+                report_event(job, &event);
+            }
+        } else {
+            report_error(job, entry, is_dir ? "change directory permissions" : "change file permissions", errno);
+        }
+    }
+    return is_dir;
+}
+
+/*
+ * This function changes the permissions of a given file/directory, looking at the job for everything
+ */
+int change_permissions(struct rper_job *job, const struct rper_entry *entry, int change_files, int change_dirs) {
+    return change_entry(job, entry, NULL, change_files, change_dirs, 1, 1, job->report_all, 0);
+}
+
+/*
+ * This function opens a directory and puts it on top of the walk's stack, to be read next;
+ * it has to be in the directory on top now (or be where the walk starts)
+ */
+void push_directory(struct rper_job *job, const struct rper_entry *entry) {
+    struct rper_walk *walk = job->walk;
+
+    // A frame one deeper than the walk has been before is new; otherwise it's reused, buffer and all
+    if (walk->nframes == walk->capacity) {
+        int capacity = walk->capacity * 2 + 16;
+        struct walk_frame *frames = realloc(walk->frames, capacity * sizeof(*frames));
+        if (!frames) {
+            report_error(job, entry, "open directory", ENOMEM);
+            return;
+        }
+        memset(frames + walk->capacity, 0, (capacity - walk->capacity) * sizeof(*frames));
+        walk->frames = frames;
+        walk->capacity = capacity;
+    }
+    struct walk_frame *frame = &walk->frames[walk->nframes];
+
+    // Try to open the directory
+    if (meta_opendir(job, entry, walk->nframes) != 0) {
+        report_error(job, entry, "open directory", errno);
+        return;
+    }
+    frame->entries = 0;
+    frame->local = frame->children = 0;
+    frame->nverify = frame->verify_next = 0;
+    frame->verify_used = 0;
+    if (walk->nframes > 0) {
+        strcpy(frame->name, entry->name);		// a name, so always fits; where the walk starts is walk->root
+    }
+
+    // Its policy file, if it has one; a directory whose policy can't be read is left alone
+    frame->policy = NULL;
+    if (job->policy) {
+        struct rper_policy *parent = walk->nframes > 0 ? walk->frames[walk->nframes - 1].policy : NULL;
+        struct rper_entry policy_file = {walk, walk->nframes, frame->reader.fd, POLICY_FILE};
+        if (meta_load_policy(job, &policy_file, parent, &frame->policy) != 0) {
+            report_error(job, &policy_file, "read policy", errno);
+            dir_close(&frame->reader);
+            return;
+        }
+    }
+    // Where it is in the overlay's upper layer, if it's on one
+    frame->overlay = OVERLAY_NONE;
+    if (job->overlay && meta_overlay_enter(job, entry, walk->nframes) != 0) {
+        report_error(job, entry, "find overlay upper layer", errno);	// what's in it is taken to be in a lower layer only
+    }
+    walk->nframes++;
+    if (job->metrics) {
+        METRIC_ADD(job->metrics, dirs, 1);
+        METRIC_SET(job->metrics, depth, walk->nframes);
+    }
+}
+
+/*
+ * This function takes the directory on top of the walk's stack off, once it has all been read
+ */
+void pop_directory(struct rper_job *job) {
+    struct rper_walk *walk = job->walk;
+    struct walk_frame *frame = &walk->frames[walk->nframes - 1];
+    struct rper_entry entry;
+    if (job->verify) {
+        verify_directory(job, walk->nframes - 1);	// while it's still open to find them in
+    }
+    frame_entry(walk, walk->nframes - 1, &entry);
+    if (job->estimate) {
+        estimate_directory(job, &entry, frame->entries, walk->nframes - 1);
+    }
+    if (job->fingerprint) {
+        fingerprint_directory(job, walk->nframes - 1);
+    }
+    policy_unref(frame->policy);
+    frame->policy = NULL;
+    if (frame->overlay == OVERLAY_UPPER) {
+        close(frame->upper_fd);
+    }
+    walk->nframes--;			// off the stack first; if closing hangs, the walk carries on without it
+    if (job->metrics) {
+        METRIC_SET(job->metrics, depth, walk->nframes);
+    }
+    meta_closedir(job, &frame->reader, &entry);
+}
+
+/*
+ * This function is the walk. It lists all files and directories inside each directory, and calls
+ * change_permissions on each one; if recursion is enabled, any subdirectories it encounters are
+ * gone into straight away, and the rest of the directory is finished after them.
+ * It can be started again by another thread part way through (when a thread hangs); the start of the
+ * walk moves on to its next stage before each step, so a step that hung isn't tried again.
+ * Like change_entry, it is always inlined into the walk's variants, with the settings as constants;
+ * generic is the one that handles everything (estimates, fingerprints, samples, histograms, checks, overlays, verifying).
+ */
+static inline __attribute__((always_inline))
+void walk_entries(struct rper_job *job, int change_files, int change_dirs,
+                  int generic, int report, int report_all, int full) {
+    struct rper_walk *walk = job->walk;
+    dir_entry *entry;			// Struct to hold the details of each entry (file/directory)
+    struct rper_entry found;	// Where it is; its name, in the directory on top of the stack (no full path)
+
+    // First, the root itself (eg. with -i)
+    frame_entry(walk, 0, &found);
+    if (walk->stage == 0) {
+        walk->stage = 1;
+        if (walk->root_files || walk->root_dirs) {
+            walk->root_is_dir = change_permissions(job, &found, walk->root_files, walk->root_dirs);
+        }
+    }
+    // Then open it, to start on what's inside
+    if (walk->stage == 1) {
+        walk->stage = 2;
+        if (walk->descend && walk->root_is_dir) {
+            push_directory(job, &found);
+        }
+    }
+
+    // Loop through all entries in the directory on top of the stack, until there are none left
+    while (walk->nframes > 0) {
+        int depth = walk->nframes - 1;
+        if ((entry = meta_readdir(job, depth)) == NULL) {
+            pop_directory(job);					// all done with this directory, back to the one it is in
+            continue;
+        }
+
+        // Skip the current directory (.) and the parent directory (..)
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (job->metrics) {
+            METRIC_ADD(job->metrics, entries, 1);
+        }
+
+        // The entry is its name in the directory on top; the full path is only put together if it's printed
+        found.parent = depth;
+        found.dirfd = walk->frames[depth].reader.fd;
+        found.name = entry->d_name;
+        const struct rper_policy *policy = generic ? walk->frames[depth].policy : NULL;
+        if (generic && policy && policy_excludes(policy, entry->d_name)) {
+            continue;							// left alone, and anything in it
+        }
+
+        // When estimating, entries are only counted
+        if (generic && job->estimate) {
+            walk->frames[depth].entries++;
+            if (estimate_entry(job, &found, entry->d_type) && job->recursive) {
+                push_directory(job, &found);
+            }
+            continue;
+        }
+        // When fingerprinting, every entry is stat'ed (symlinks and all), and only hashed
+        if (generic && job->fingerprint) {
+            if (fingerprint_entry(job, &found) && job->recursive) {
+                push_directory(job, &found);
+            }
+            continue;
+        }
+
+        int is_dir = (entry->d_type == DT_DIR);
+        // Each directory in the top level is its own subtree in the histogram, everything else there is "."
+        if (generic && depth == 0 && job->histogram) {
+            job->subtree = is_dir ? histogram_subtree(job->histogram, entry->d_name) : 0;
+        }
+
+        // When sampling, the type has to be known before deciding (a filesystem without d_type costs an extra stat)
+        unsigned char d_type = entry->d_type;
+        struct stat statbuf;
+        if (generic && job->sample_rate > 0 && d_type == DT_UNKNOWN && meta_lstat(job, &found, &statbuf) == 0) {
+            d_type = IFTODT(statbuf.st_mode);
+            is_dir = (d_type == DT_DIR);
+        }
+        int wanted = entry_needs_stat(d_type, change_files, change_dirs, report_all, generic && job->histogram);
+        if (generic && wanted && job->sample_rate > 0) {
+            wanted = (d_type == DT_REG || d_type == DT_DIR) && sample_entry(job, is_dir);
+        }
+
+        // Change permissions of the file/directory, only paying for the stat if the entry can be changed or reported
+        if (wanted) {
+            if (change_entry(job, &found, policy, change_files, change_dirs, generic, report, report_all, full) &&
+                    d_type == DT_UNKNOWN) {
+                is_dir = 1;						// readdir didn't know, but the stat did
+                if (generic && depth == 0 && job->histogram) {
+                    job->subtree = histogram_subtree(job->histogram, entry->d_name);
+                }
+            }
+        }
+
+        // If recursion is enabled and this entry is a directory, go into it next
+        if (job->recursive && is_dir) {
+            push_directory(job, &found);
+        }
+    }
+}
+
+/*
+ * The walk's variants. Most runs are a plain change of files, directories or both, with output shown,
+ * quiet (nothing to tell; -S), or verbose (-v), and a mode with wildcards or without; each of those
+ * combinations gets a walk of its own, compiled with them as constants, so the per-entry work has no
+ * checks left on settings that can't change. Anything else (estimates, samples, histograms, checks)
+ * goes through the generic walk. Picked once, when a walk starts (select_walk).
+ */
+void walk_generic(struct rper_job *job) {
+    walk_entries(job, job->change_files, job->change_dirs, 1, 1, job->report_all, 0);
+}
+
+#define WALK_VARIANT(name, files, dirs, report, report_all, full) \
+    void name(struct rper_job *job) { walk_entries(job, files, dirs, 0, report, report_all, full); }
+#define WALK_VARIANTS(types, files, dirs) \
+    WALK_VARIANT(walk_##types##_quiet,             files, dirs, 0, 0, 0) \
+    WALK_VARIANT(walk_##types##_quiet_full,        files, dirs, 0, 0, 1) \
+    WALK_VARIANT(walk_##types##_normal,            files, dirs, 1, 0, 0) \
+    WALK_VARIANT(walk_##types##_normal_full,       files, dirs, 1, 0, 1) \
+    WALK_VARIANT(walk_##types##_verbose,           files, dirs, 1, 1, 0) \
+    WALK_VARIANT(walk_##types##_verbose_full,      files, dirs, 1, 1, 1)
+
+WALK_VARIANTS(files, 1, 0)
+WALK_VARIANTS(dirs, 0, 1)
+WALK_VARIANTS(both, 1, 1)
+
+typedef void (*walk_fn)(struct rper_job *job);
+
+// Indexed by what is changed (files, dirs, both), the output (quiet, normal, verbose), and whether the mode is full
+static walk_fn const walk_variants[3][3][2] = {
+    {{walk_files_quiet, walk_files_quiet_full}, {walk_files_normal, walk_files_normal_full},
+     {walk_files_verbose, walk_files_verbose_full}},
+    {{walk_dirs_quiet, walk_dirs_quiet_full}, {walk_dirs_normal, walk_dirs_normal_full},
+     {walk_dirs_verbose, walk_dirs_verbose_full}},
+    {{walk_both_quiet, walk_both_quiet_full}, {walk_both_normal, walk_both_normal_full},
+     {walk_both_verbose, walk_both_verbose_full}},
+};
+
+/*
+ * This function picks the walk for the job's settings; a variant when there is one, otherwise the generic walk
+ */
+walk_fn select_walk(const struct rper_job *job) {
+    if (job->estimate || job->fingerprint || job->sample_rate > 0 || job->histogram || job->check || job->policy || job->overlay ||
+            job->verify || (!job->change_files && !job->change_dirs)) {
+        return walk_generic;
+    }
+    int types = job->change_files && job->change_dirs ? 2 : job->change_dirs ? 1 : 0;
+    int output = job->report_all ? 2 : job->on_event ? 1 : 0;	// quiet only when nobody is listening
+    return walk_variants[types][output][job->mode.keep == 0];
+}
+
+/*
+ * This function runs the walk picked for the job
+ */
+void walk_directories(struct rper_job *job) {
+    job->walk->walker(job);
+}
+
+/*
+ * This function records the operation the watchdog gave up on as abandoned, to be retried later,
+ * and reports it; or, if it was reading a change back (see verify), as changed but not verified,
+ * as the change itself was made. It runs in the thread that carries on with the walk, so the job is
+ * only ever touched by one thread at a time.
+ */
+void report_abandoned(struct rper_job *job) {
+    struct rper_walk *walk = job->walk;
+    int changed = strcmp(walk->op, "verify permissions") == 0;
+    char ***list = changed ? &job->unverified : &job->abandoned;
+    int *count = changed ? &job->nunverified : &job->nabandoned;
+    char **paths = realloc(*list, (*count + 1) * sizeof(char *));
+    if (paths) {
+        *list = paths;
+        paths[(*count)++] = strdup(walk->op_path);
+    }
+    struct rper_entry entry = {NULL, -1, AT_FDCWD, walk->op_path};	// by now, only its path is left to go on
+    report_error(job, &entry, walk->op, ETIMEDOUT);
+    walk->abandoned = 0;
+}
+
+/*
+ * This function is where a walk's (replacement) thread starts, when the job has an operation timeout
+ */
+void *walk_worker(void *arg) {
+    struct rper_job *job = arg;
+    struct rper_walk *walk = job->walk;
+    if (walk->abandoned) {
+        report_abandoned(job);
+    }
+    walk_directories(job);
+    pthread_mutex_lock(&walk->lock);
+    walk->done = 1;
+    pthread_cond_signal(&walk->finished_walk);
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+/*
+ * This function gives up on the operation the walk's thread is stuck in (the watchdog holds the lock).
+ * If it was reading a directory, the rest of that directory is given up on too.
+ * Then a new thread carries on with the walk.
+ */
+void abandon_operation(struct rper_job *job) {
+    struct rper_walk *walk = job->walk;
+    entry_path(&walk->op_entry, walk->op_path, sizeof(walk->op_path));	// while what it points into is still there
+
+    // The stuck thread keeps what it is using; the directory it was reading (left open),
+    // or the buffer the name it was working on is in. It's handed over, for it to free when (if) it wakes up;
+    // without the memory to note that, it's left to leak rather than be freed from under the thread
+    struct stuck_thread *stuck = calloc(1, sizeof(*stuck));
+    struct stuck_thread left;
+    if (!stuck) {
+        stuck = &left;
+    }
+    stuck->thread = walk->worker;
+    if (walk->reading) {
+        walk->nframes--;
+        dir_reader_unshare(&walk->frames[walk->nframes].reader, &stuck->reader);
+        policy_unref(walk->frames[walk->nframes].policy);
+        walk->frames[walk->nframes].policy = NULL;
+        if (walk->frames[walk->nframes].overlay == OVERLAY_UPPER) {
+            close(walk->frames[walk->nframes].upper_fd);
+        }
+    } else if (walk->op_entry.parent >= 0) {
+        struct walk_frame *parent = &walk->frames[walk->op_entry.parent];
+        dir_reader_unshare(&parent->reader, &stuck->reader);
+        stuck->reader.fd = -1;					// the directory it's in is still the walk's
+        if (parent->verify_next > 0 && walk->op_entry.name == parent->verify_names + parent->verify[parent->verify_next - 1].name) {
+            stuck->verify_names = verify_unshare(parent);	// stuck reading a change back
+        }
+    } else {
+        stuck->reader.fd = -1;					// where the walk starts; nothing of the walk's in use
+    }
+    if (stuck != &left) {
+        stuck->next = walk->stuck_threads;
+        walk->stuck_threads = stuck;
+    }
+    walk->busy = 0;
+    walk->abandoned = 1;
+    walk->stuck++;
+    if (pthread_create(&walk->worker, NULL, walk_worker, job) == 0) {
+        pthread_detach(walk->worker);
+    } else {
+        walk->worker = pthread_self();			// no thread to spare; the rest of the walk is abandoned too
+        walk->done = 1;
+    }
+}
+
+/*
+ * This function runs a walk from the given root. With an operation timeout, the walk runs in its
+ * own thread, and this thread is the watchdog; any operation taking too long is abandoned.
+ * The walk is kept with the job afterwards, so the next one (eg. in watch mode) reuses its frames
+ * and buffers, rather than allocating them again.
+ * Returns 0 if there were no errors, otherwise -1.
+ */
+int run_walk(struct rper_job *job, const char *root, int root_files, int root_dirs, int descend) {
+    long errors_before = job->errors;
+    struct rper_walk *walk = job->walk;
+    if (!walk) {
+        if (!(walk = calloc(1, sizeof(*walk)))) {
+            struct rper_entry entry = {NULL, -1, AT_FDCWD, root};
+            report_error(job, &entry, "open directory", ENOMEM);
+            return -1;
+        }
+        pthread_mutex_init(&walk->lock, NULL);
+        pthread_cond_init(&walk->finished_walk, NULL);
+        job->walk = walk;
+    }
+    walk->nframes = 0;
+    walk->stage = 0;
+    walk->root = root;
+    walk->root_files = root_files;
+    walk->root_dirs = root_dirs;
+    walk->root_is_dir = 1;						// taken to be a directory, unless looking at it says otherwise
+    walk->descend = descend;
+    walk->walker = select_walk(job);
+    walk->done = walk->busy = walk->abandoned = 0;
+
+    if (job->op_timeout <= 0) {
+        walk_directories(job);								// no watchdog, so this thread does the walking
+        return job->errors == errors_before ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    if (pthread_create(&walk->worker, NULL, walk_worker, job) == 0) {
+        pthread_detach(walk->worker);
+    } else {
+        walk->worker = pthread_self();			// no thread to spare; walk here, without a watchdog
+        pthread_mutex_unlock(&walk->lock);
+        walk_directories(job);
+        pthread_mutex_lock(&walk->lock);
+        walk->done = 1;
+    }
+
+    // Keep an eye on the walk, checking every tenth of a second
+    while (!walk->done) {
+        struct timespec deadline, now;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&walk->finished_walk, &walk->lock, &deadline);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - walk->op_started.tv_sec) + (now.tv_nsec - walk->op_started.tv_nsec) / 1e9;
+        if (!walk->done && walk->busy && elapsed > job->op_timeout) {
+            abandon_operation(job);
+        }
+    }
+
+    if (walk->abandoned) {
+        report_abandoned(job);					// there was no new worker to report it
+    }
+    if (walk->stuck == 0) {
+        pthread_mutex_unlock(&walk->lock);
+        return job->errors == errors_before ? 0 : -1;
+    }
+
+    // Any threads still stuck need the walk when (if) they wake up; the last of them frees it,
+    // and the job's next walk starts afresh
+    walk->finished = 1;
+    for (int i = 0; i < walk->capacity; i++) {
+        dir_reader_free(&walk->frames[i].reader);
+        free(walk->frames[i].verify);
+        free(walk->frames[i].verify_names);
+    }
+    free(walk->frames);
+    walk->frames = NULL;
+    walk->capacity = 0;
+    pthread_mutex_unlock(&walk->lock);
+    job->walk = NULL;
+    return job->errors == errors_before ? 0 : -1;
+}
+
+/* Prefetch */
+/*
+ * On a cold cache, nearly all of a run is spent waiting on directory reads and stats, one at a time.
+ * With prefetch set, a few threads read directories and stat their entries ahead of the walk, many at
+ * once, only so the kernel has them cached (what they find is thrown away); the walk itself, and so
+ * the output, stays in the same single order. Directories waiting to be read are kept on a stack,
+ * the first one listed on top, so the prefetch roughly follows the walk's own (depth first) order.
+ * Their records are recycled, by size, and each thread keeps its own directory buffer and name
+ * storage, so once going, prefetching allocates nothing either.
+ */
+#define PREFETCH_MAX_PENDING 65536				// past this many directories waiting, new ones are left to the walk
+#define PREFETCH_SIZE_STEP 256					// records are sized in steps of this many bytes of path
+
+struct prefetch_dir {
+    struct prefetch_dir *next;
+    int steps;								// its size, in PREFETCH_SIZE_STEPs
+    char path[];
+};
+
+struct prefetch {
+    pthread_mutex_t lock;
+    pthread_cond_t more;					// signalled when directories are added, or prefetching stops
+    struct prefetch_dir *pending;			// directories waiting to be read, the next one on top
+    int npending;
+    struct prefetch_dir *spare[PATH_MAX / PREFETCH_SIZE_STEP + 1];	// records done with, by size, to be reused
+    int running;							// threads running
+    int idle;								// of those, waiting for a directory
+    int refs;								// the threads, and the job, until it's done; the last one frees it
+    int stop;								// the walk is done (or everything has been read)
+    int recursive;
+    struct rper_metrics *metrics;			// the job's, for the queue's length; NULL once the job is done with the prefetch
+};
+
+/*
+ * What each prefetch thread keeps, from one directory to the next
+ */
+struct prefetch_thread {
+    struct prefetch *prefetch;
+    struct dir_reader reader;
+    char *names;							// the subdirectories found in the directory being read, one after another
+    size_t names_used;
+    size_t names_size;
+    int *subdirs;							// where each one's name starts
+    int nsubdirs;
+    int subdirs_size;
+};
+
+/*
+ * This function puts a directory (name, in dir_path; or just dir_path if name is NULL) on the
+ * prefetch stack, in a spare record if there is one big enough (the lock is held)
+ */
+void prefetch_push(struct prefetch *prefetch, const char *dir_path, const char *name) {
+    size_t len = strlen(dir_path) + (name ? strlen(name) + 1 : 0);
+    int steps = len / PREFETCH_SIZE_STEP + 1;
+    if (prefetch->npending >= PREFETCH_MAX_PENDING || len >= PATH_MAX) {
+        return;
+    }
+    struct prefetch_dir *dir = prefetch->spare[steps];
+    if (dir) {
+        prefetch->spare[steps] = dir->next;
+    } else if ((dir = malloc(sizeof(*dir) + steps * PREFETCH_SIZE_STEP)) != NULL) {
+        dir->steps = steps;
+    } else {
+        return;									// it will just be read cold
+    }
+    if (name) {
+        sprintf(dir->path, "%s/%s", dir_path, name);
+    } else {
+        strcpy(dir->path, dir_path);
+    }
+    dir->next = prefetch->pending;
+    prefetch->pending = dir;
+    prefetch->npending++;
+    if (prefetch->metrics) {
+        METRIC_SET(prefetch->metrics, prefetch_queue, prefetch->npending);
+    }
+}
+
+/*
+ * This function drops a reference to the prefetch, freeing it with the last one (the lock is held)
+ */
+void prefetch_release(struct prefetch *prefetch) {
+    int last = --prefetch->refs == 0;
+    pthread_mutex_unlock(&prefetch->lock);
+    if (last) {
+        while (prefetch->pending) {
+            struct prefetch_dir *next = prefetch->pending->next;
+            free(prefetch->pending);
+            prefetch->pending = next;
+        }
+        for (int i = 0; i <= PATH_MAX / PREFETCH_SIZE_STEP; i++) {
+            while (prefetch->spare[i]) {
+                struct prefetch_dir *next = prefetch->spare[i]->next;
+                free(prefetch->spare[i]);
+                prefetch->spare[i] = next;
+            }
+        }
+        pthread_mutex_destroy(&prefetch->lock);
+        pthread_cond_destroy(&prefetch->more);
+        free(prefetch);
+    }
+}
+
+/*
+ * This function keeps the name of a subdirectory found, until the directory has been read.
+ * Returns 0, or -1 if there's no room (it's left to the walk).
+ */
+int prefetch_keep_name(struct prefetch_thread *thread, const char *name) {
+    size_t len = strlen(name) + 1;
+    if (thread->names_used + len > thread->names_size) {
+        size_t size = thread->names_size * 2 + len + 4096;
+        char *names = realloc(thread->names, size);
+        if (!names) {
+            return -1;
+        }
+        thread->names = names;
+        thread->names_size = size;
+    }
+    if (thread->nsubdirs == thread->subdirs_size) {
+        int size = thread->subdirs_size * 2 + 64;
+        int *subdirs = realloc(thread->subdirs, size * sizeof(int));
+        if (!subdirs) {
+            return -1;
+        }
+        thread->subdirs = subdirs;
+        thread->subdirs_size = size;
+    }
+    thread->subdirs[thread->nsubdirs++] = thread->names_used;
+    memcpy(thread->names + thread->names_used, name, len);
+    thread->names_used += len;
+    return 0;
+}
+
+/*
+ * This function reads one directory and stats everything in it, then puts its subdirectories
+ * on the stack, in reverse, so the first one listed is read next
+ */
+void prefetch_directory(struct prefetch_thread *thread, const char *dir_path) {
+    struct prefetch *prefetch = thread->prefetch;
+    dir_entry *entry;
+    struct stat statbuf;
+
+    if (meta_prefetch_opendir(&thread->reader, dir_path) != 0) {
+        return;									// the walk will find (and report) it
+    }
+    thread->names_used = 0;
+    thread->nsubdirs = 0;
+    int fd = thread->reader.fd;
+    while ((entry = meta_prefetch_readdir(&thread->reader)) != NULL && !__atomic_load_n(&prefetch->stop, __ATOMIC_RELAXED)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        int stat_ok = meta_prefetch_lstat(fd, entry->d_name, &statbuf) == 0;
+        int is_dir = entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && stat_ok && S_ISDIR(statbuf.st_mode));
+        if (is_dir && prefetch->recursive && prefetch_keep_name(thread, entry->d_name) != 0) {
+            break;
+        }
+    }
+    dir_close(&thread->reader);
+
+    pthread_mutex_lock(&prefetch->lock);
+    for (int i = thread->nsubdirs - 1; i >= 0; i--) {
+        prefetch_push(prefetch, dir_path, thread->names + thread->subdirs[i]);
+    }
+    if (thread->nsubdirs) {
+        pthread_cond_broadcast(&prefetch->more);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+/*
+ * This function is a prefetch thread; it reads directories off the stack until the walk is done,
+ * or there are none left and no other thread can find any more
+ */
+void *prefetch_worker(void *arg) {
+    struct prefetch_thread thread = {0};
+    struct prefetch *prefetch = thread.prefetch = arg;
+
+    pthread_mutex_lock(&prefetch->lock);
+    while (!prefetch->stop) {
+        if (!prefetch->pending) {
+            if (prefetch->idle + 1 == prefetch->running) {
+                __atomic_store_n(&prefetch->stop, 1, __ATOMIC_RELAXED);	// everything has been read
+                pthread_cond_broadcast(&prefetch->more);
+                break;
+            }
+            prefetch->idle++;
+            pthread_cond_wait(&prefetch->more, &prefetch->lock);
+            prefetch->idle--;
+            continue;
+        }
+        struct prefetch_dir *dir = prefetch->pending;
+        prefetch->pending = dir->next;
+        prefetch->npending--;
+        if (prefetch->metrics) {
+            METRIC_SET(prefetch->metrics, prefetch_queue, prefetch->npending);
+        }
+        pthread_mutex_unlock(&prefetch->lock);
+
+        prefetch_directory(&thread, dir->path);
+
+        pthread_mutex_lock(&prefetch->lock);
+        dir->next = prefetch->spare[dir->steps];	// done with; kept for the next one its size
+        prefetch->spare[dir->steps] = dir;
+    }
+    prefetch->running--;
+    prefetch_release(prefetch);
+
+    dir_reader_free(&thread.reader);
+    free(thread.names);
+    free(thread.subdirs);
+    return NULL;
+}
+
+/*
+ * This function starts the job's prefetch threads on the given directory.
+ * Returns the prefetch, to stop once the walk is done, or NULL if there is none.
+ */
+struct prefetch *prefetch_start(struct rper_job *job, const char *dir_path) {
+    // It only makes sense for a real run; a throttle is there to keep the load down, not up
+    if (job->prefetch <= 0 || job->estimate || job->throttle) {
+        return NULL;
+    }
+    struct prefetch *prefetch = calloc(1, sizeof(*prefetch));
+    if (!prefetch) {
+        return NULL;
+    }
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->more, NULL);
+    prefetch->recursive = job->recursive;
+    prefetch->refs = 1;
+    prefetch->metrics = job->metrics;
+
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch_push(prefetch, dir_path, NULL);
+    for (int i = 0; i < job->prefetch; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, prefetch_worker, prefetch) != 0) {
+            break;								// fewer threads, that's all
+        }
+        pthread_detach(thread);
+        prefetch->running++;
+        prefetch->refs++;
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+    return prefetch;
+}
+
+/*
+ * This function stops the prefetch, once the walk is done. Threads part way through a directory
+ * notice and leave on their own (a thread stuck on a hung mount never does, but holds nothing of the job's).
+ */
+void prefetch_stop(struct prefetch *prefetch) {
+    if (!prefetch) {
+        return;
+    }
+    pthread_mutex_lock(&prefetch->lock);
+    __atomic_store_n(&prefetch->stop, 1, __ATOMIC_RELAXED);
+    if (prefetch->metrics) {
+        METRIC_SET(prefetch->metrics, prefetch_queue, 0);
+        prefetch->metrics = NULL;				// the threads still going have nothing more to tell
+    }
+    pthread_cond_broadcast(&prefetch->more);
+    prefetch_release(prefetch);
+}
+
+/*
+ * This function runs a job over the given directory; the library's main entry point.
+ * Returns 0 if there were no errors, otherwise -1 (job->errors has the count).
+ */
+int rper_run(struct rper_job *job, const char *dir_path) {
+    // The directory itself, and the entries directly in it, are counted as "." in the histogram
+    if (job->histogram) {
+        if (job->histogram->nsubtrees == 0) {
+            histogram_subtree(job->histogram, ".");
+        }
+        job->subtree = 0;
+    }
+
+    // If -i flag is used and we are processing directories, change the top-level directory too
+    int include_dir = job->change_dirs && job->include_dir && !job->estimate && !job->fingerprint;
+
+    // Start processing the directory, with the prefetch (if any) reading ahead
+    struct prefetch *prefetch = prefetch_start(job, dir_path);
+    int result = run_walk(job, dir_path, 0, include_dir, 1);
+    prefetch_stop(prefetch);
+    return result;
+}
+
+/*
+ * This function applies the job to a single file/directory, eg. one that has just appeared.
+ * If descend is set and it is a directory, everything in it is processed too (if the job is recursive).
+ * Returns 0 if there were no errors, otherwise -1.
+ */
+int rper_apply(struct rper_job *job, const char *path, int descend) {
+    return run_walk(job, path, job->change_files, job->change_dirs, descend && job->recursive);
+}
+
+/*
+ * This function frees what a job has allocated; the lists of abandoned and unverified paths, and the walk it keeps
+ */
+void rper_job_free(struct rper_job *job) {
+    if (job->walk) {
+        walk_free(job->walk);
+        job->walk = NULL;
+    }
+    for (int i = 0; i < job->nabandoned; i++) {
+        free(job->abandoned[i]);
+    }
+    free(job->abandoned);
+    job->abandoned = NULL;
+    job->nabandoned = 0;
+    for (int i = 0; i < job->nunverified; i++) {
+        free(job->unverified[i]);
+    }
+    free(job->unverified);
+    job->unverified = NULL;
+    job->nunverified = 0;
+    for (int i = 0; i < job->nmismatches; i++) {
+        free(job->mismatches[i].path);
+    }
+    free(job->mismatches);
+    job->mismatches = NULL;
+    job->nmismatches = 0;
+}
+
+/* Command line interface */
+// Leave this out (-DRPER_NO_MAIN) to build rper as a library, see rper.h
+#ifndef RPER_NO_MAIN
+
+#define EXIT_INCOMPLETE 2						// --check/--sample found nothing to change, but couldn't look at everything
+
+/*
+ * Output settings for the command line; the job's callback (print_event) follows these
+ */
+struct output_options {
+    int suppress_output;					// suppress normal output, suppress all output except errors and completion
+    int suppress_all_output;				// suppress all output, suppress everything except completion output
+    int verbose;							// verbose switch, prints all output, even skipped directories/files
+    FILE *stream;							// where normal output goes (stdout)
+    FILE *errors;							// where error output goes (stderr)
+    int watching;							// set once the first pass of --watch is done; only changes are shown after that
+    struct change_hook *hook;				// with --on-change, where the changed paths are collected
+    const struct output_format *changed;	// how changes are printed (NULL for the built-in format)
+    const struct output_format *skipped;	// and skips
+};
+
+/*
+ * This function prints some basic infoirmation to guide the user while using rper.
+ * The expectation is that this function will fire, 
+ * if using any of the help flags [h | H], or if rper returns an error.
+ */
+void print_usage() {
+    printf("Usage: rper [-f | -d] [-i]  [-n] [-s | -S] [-p mode] [-h | -H] <directory>\n");
+    printf("  -f : Search files only (default function if no flags are provided)\n");
+    printf("  -d : Search directories only (can be used with -f flag)\n");
+    printf("  -i : Include the given directory in the changes (with -d flag only)\n");
+    printf("  -n : Do not apply changes recursively (changes only affect specified directory)\n");
+    printf("  -s : Suppress normal output, only show errors\n");
+    printf("  -S : Suppress all output, including errors\n");
+    printf("  -p : Specify permissions in octal format (e.g., 755, 0644)\n");
+    printf("  -c : Show permissions in rwx notation (e.g., rw-r--r--) instead of octal\n");
+    printf("  -h, -H: Display this help message\n");
+    printf("  --check : Change nothing; show what would change, and exit with failure if anything would\n");
+    printf("  --histogram : Show how many files/directories have each permissions, overall and per top-level subtree\n");
+    printf("  --sample <rate> : Like --check, but only look at a random sample (eg. 1%%), and estimate the rest\n");
+    printf("  --estimate : Change nothing; count entries and estimate how long a run would take (no -p needed)\n");
+    printf("  --watch : After the first pass, keep running, and change new or altered entries as they appear\n");
+    printf("  --max-ops <n> : Limit stats/chmods to n per second (shared by every job in daemon mode)\n");
+    printf("  --timeout <secs> : Give up on any stat/chmod/directory read taking longer, list it, and carry on\n");
+    printf("  --prefetch <n> : Use n threads to read ahead of the changes, warming the cache\n");
+    printf("  --policy : Honour .rperpolicy files in the directories (modes, rules, excludes for their subtrees)\n");
+    printf("  --printf <template> : Print each change/skip as the template says (%%p path, %%o/%%O old/new mode, %%r/%%R in rwx,\n");
+    printf("                        %%n name, %%t type, %%a C/S, %%w mode given, %%i inode, %%u uid, %%g gid, %%d depth)\n");
+    printf("  --on-change <cmd> : Run cmd on the changed files/directories, in batches (like find -exec cmd {} +)\n");
+    printf("  --overlay <count|skip|cap:size> : On overlayfs, count, skip, or cap (bytes) copy-ups from lower layers\n");
+    printf("  --verify : Read back what was changed, once each directory is done, and list any that didn't keep\n");
+    printf("  --stats-file <file> : Keep live counters (entries, changes, errors, latency) in file, mapped into memory\n");
+    printf("  --prom-file <file> : Rewrite file with the same counters every 5 seconds, for Prometheus\n");
+    printf("  --fingerprint <file> : Change nothing; write a hash of the permissions of each subtree to file (- for stdout)\n");
+    printf("  --compare <file> <file> : Compare two fingerprint files, showing the directories that differ\n");
+    printf("  --daemon <socket> : Run as a daemon (rperd), taking jobs over the given Unix socket\n");
+    printf("  --workers <n> : Number of jobs the daemon runs at once (default 4)\n");
+}
+
+/*
+ * This function prints some basic 'about' information, regarding rper 
+ */
+void print_about() {
+    printf("rper (pronounced: 'arr per'). version: %s\n", version);
+    printf("Author: Dale Hitchenor");
+    printf("Source: https://github.com/dhitchenor/rper");
+}
+
+/* Output formats (-c, --printf) */
+/*
+ * What is printed for each change/skip is a format, compiled once into a list of ops; text to copy out, or a field
+ * of the event. The built-in formats are lists like any other (see format_changed), and --printf compiles the
+ * user's template into one. Modes come from tables made once at startup, so no op has any formatting left to do.
+ */
+enum format_field {
+    FORMAT_TEXT,							// text, as is
+    FORMAT_PATH,							// %p
+    FORMAT_NAME,							// %n, the entry's name (the path given, where the walk starts)
+    FORMAT_TYPE,							// %t, F or D
+    FORMAT_ACTION,							// %a, C (changed), S (skipped) or O (left in an overlay's lower layer)
+    FORMAT_OLD_OCTAL,						// %o
+    FORMAT_NEW_OCTAL,						// %O
+    FORMAT_OLD_RWX,							// %r
+    FORMAT_NEW_RWX,							// %R
+    FORMAT_MODE,							// %w, the mode as given, wildcards and all
+    FORMAT_INODE,							// %i
+    FORMAT_UID,								// %u
+    FORMAT_GID,								// %g
+    FORMAT_DEPTH							// %d, levels below the directory given (0 for what's directly in it)
+};
+
+struct format_op {
+    enum format_field field;
+    const char *text;						// FORMAT_TEXT only
+    size_t len;
+};
+
+struct output_format {
+    const struct format_op *ops;
+    int nops;
+};
+
+static char format_octal[512][4];			// each mode, as rper has always printed it (eg. "644", "0" for none)
+static char format_rwx[512][10];			// and in rwx notation (eg. "rw-r--r--")
+
+/*
+ * This function fills in the mode tables; called once, before anything is printed
+ */
+void format_tables_init(void) {
+    for (int mode = 0; mode < 512; mode++) {
+        snprintf(format_octal[mode], sizeof(format_octal[mode]), "%o", mode);
+        for (int bit = 0; bit < 9; bit++) {
+            format_rwx[mode][bit] = mode & (0400 >> bit) ? "rwx"[bit % 3] : '-';
+        }
+        format_rwx[mode][9] = '\0';
+    }
+}
+
+#define FORMAT_TEXT_OP(s) {FORMAT_TEXT, s, sizeof(s) - 1}
+#define FORMAT_FIELD_OP(field) {field, NULL, 0}
+
+// The built-in formats; "(F 600 -> [6*4] 644) path", "(F rw------- -> [6*4] rw-r--r--) path" (-c), "(F -> S) path",
+// and "(F -> O) path" for what was left in an overlay's lower layer
+static const struct format_op format_changed_ops[] = {
+    FORMAT_TEXT_OP("("), FORMAT_FIELD_OP(FORMAT_TYPE), FORMAT_TEXT_OP(" "), FORMAT_FIELD_OP(FORMAT_OLD_OCTAL),
+    FORMAT_TEXT_OP(" -> ["), FORMAT_FIELD_OP(FORMAT_MODE), FORMAT_TEXT_OP("] "), FORMAT_FIELD_OP(FORMAT_NEW_OCTAL),
+    FORMAT_TEXT_OP(") "), FORMAT_FIELD_OP(FORMAT_PATH), FORMAT_TEXT_OP("\n")
+};
+static const struct format_op format_changed_rwx_ops[] = {
+    FORMAT_TEXT_OP("("), FORMAT_FIELD_OP(FORMAT_TYPE), FORMAT_TEXT_OP(" "), FORMAT_FIELD_OP(FORMAT_OLD_RWX),
+    FORMAT_TEXT_OP(" -> ["), FORMAT_FIELD_OP(FORMAT_MODE), FORMAT_TEXT_OP("] "), FORMAT_FIELD_OP(FORMAT_NEW_RWX),
+    FORMAT_TEXT_OP(") "), FORMAT_FIELD_OP(FORMAT_PATH), FORMAT_TEXT_OP("\n")
+};
+static const struct format_op format_skipped_ops[] = {
+    FORMAT_TEXT_OP("("), FORMAT_FIELD_OP(FORMAT_TYPE), FORMAT_TEXT_OP(" -> S) "), FORMAT_FIELD_OP(FORMAT_PATH),
+    FORMAT_TEXT_OP("\n")
+};
+static const struct output_format format_changed = {format_changed_ops, 11};
+static const struct output_format format_changed_rwx = {format_changed_rwx_ops, 11};
+static const struct format_op format_copy_up_avoided_ops[] = {
+    FORMAT_TEXT_OP("("), FORMAT_FIELD_OP(FORMAT_TYPE), FORMAT_TEXT_OP(" -> O) "), FORMAT_FIELD_OP(FORMAT_PATH),
+    FORMAT_TEXT_OP("\n")
+};
+static const struct output_format format_skipped = {format_skipped_ops, 5};
+static const struct output_format format_copy_up_avoided = {format_copy_up_avoided_ops, 5};
+
+/*
+ * This function compiles a --printf template; fields are '%' and a letter (see enum format_field), and
+ * '\n', '\t', '\\' are escapes, as in printf. Nothing is added; a template wanting a line each ends with '\n'.
+ * Returns 0 on success, -1 (with an error printed) if the template isn't valid.
+ * The ops point into text, a copy of the template the escapes are worked out in; both are freed with format_free.
+ */
+int format_compile(const char *template, struct output_format *format, char **text) {
+    static const char fields[] = "pntaoOrRwiugd";	// in the order of enum format_field, from FORMAT_PATH
+    size_t len = strlen(template);
+    struct format_op *ops = malloc((len + 1) * sizeof(*ops));	// never more ops than characters
+    char *copy = malloc(len + 1);
+    if (!ops || !copy) {
+        free(ops);
+        free(copy);
+        fprintf(stderr, "Error: --printf: %s\n", strerror(ENOMEM));
+        return -1;
+    }
+
+    int nops = 0;
+    char *out = copy;
+    for (const char *c = template; *c;) {
+        if (*c == '%' && c[1] != '%') {
+            const char *field = c[1] ? strchr(fields, c[1]) : NULL;
+            if (!field) {
+                fprintf(stderr, "Error: Invalid --printf template: unknown field %%%c\n\n", c[1] ? c[1] : ' ');
+                free(ops);
+                free(copy);
+                return -1;
+            }
+            ops[nops++] = (struct format_op){FORMAT_PATH + (field - fields), NULL, 0};
+            c += 2;
+            continue;
+        }
+
+        // Text, up to the next field; it's one op, however many escapes are in it
+        if (nops == 0 || ops[nops - 1].field != FORMAT_TEXT) {
+            ops[nops++] = (struct format_op){FORMAT_TEXT, out, 0};
+        }
+        if (*c == '%') {
+            *out++ = '%';						// %%
+            c += 2;
+        } else if (*c == '\\' && (c[1] == 'n' || c[1] == 't' || c[1] == '\\')) {
+            *out++ = c[1] == 'n' ? '\n' : c[1] == 't' ? '\t' : '\\';
+            c += 2;
+        } else {
+            *out++ = *c++;
+        }
+        ops[nops - 1].len++;
+    }
+
+    format->ops = ops;
+    format->nops = nops;
+    *text = copy;
+    return 0;
+}
+
+/*
+ * This function prints a number without going through printf's format parsing
+ */
+static void format_number(FILE *stream, unsigned long long n) {
+    char digits[24];
+    char *d = digits + sizeof(digits);
+    do {
+        *--d = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    fwrite(d, 1, digits + sizeof(digits) - d, stream);
+}
+
+/*
+ * This function prints a change/skip in the given format
+ */
+void format_print(FILE *stream, const struct output_format *format, const struct rper_event *event) {
+    for (int i = 0; i < format->nops; i++) {
+        const struct format_op *op = &format->ops[i];
+        switch (op->field) {
+            case FORMAT_TEXT:      fwrite(op->text, 1, op->len, stream); break;
+            case FORMAT_PATH:      fputs(rper_event_path(event), stream); break;
+            case FORMAT_NAME:      fputs(event->entry->name, stream); break;
+            case FORMAT_TYPE:      putc(event->is_dir ? 'D' : 'F', stream); break;
+            case FORMAT_ACTION:    putc("CSEO"[event->type], stream); break;
+            case FORMAT_OLD_OCTAL: fputs(format_octal[event->old_mode & 0777], stream); break;
+            case FORMAT_NEW_OCTAL: fputs(format_octal[event->new_mode & 0777], stream); break;
+            case FORMAT_OLD_RWX:   fwrite(format_rwx[event->old_mode & 0777], 1, 9, stream); break;
+            case FORMAT_NEW_RWX:   fwrite(format_rwx[event->new_mode & 0777], 1, 9, stream); break;
+            case FORMAT_MODE:      fputs(event->mode->spec, stream); break;	// kept exactly as given, '*' and all
+            case FORMAT_INODE:     format_number(stream, event->stat->st_ino); break;
+            case FORMAT_UID:       format_number(stream, event->stat->st_uid); break;
+            case FORMAT_GID:       format_number(stream, event->stat->st_gid); break;
+            case FORMAT_DEPTH:     format_number(stream, event->entry->parent > 0 ? event->entry->parent : 0); break;	// the directory given is 0 too
+        }
+    }
+}
+
+/* Hooks (--on-change) */
+/*
+ * 'rper --on-change cmd' runs cmd on the entries that were changed, the way 'find -exec cmd {} +' does; paths are
+ * collected into batches of as many as fit on a command line, and each batch is given to cmd as its arguments
+ * (through /bin/sh -c 'cmd "$@"', so cmd can be anything the shell understands). Batches are started while the
+ * walk goes on, up to HOOK_PROCESSES at once; the walk only waits when that many are still running.
+ */
+#define HOOK_PROCESSES 4						// batches run at once
+#define HOOK_BATCH_MAX (256 * 1024)				// a batch is started once this big, even where more would fit,
+												// so hooks get going while the walk does
+struct change_hook {
+    char *script;							// the command, with "$@" after it
+    char *buffer;							// the batch's paths, one after another
+    size_t used;							// what the batch takes up of the command line so far
+    size_t limit;							// what it may take up, at most
+    char **argv;							// sh -c script rper paths...
+    int nargs;								// paths in the batch
+    int max_args;
+    pid_t running[HOOK_PROCESSES];			// oldest first
+    int nrunning;
+    long batches;							// batches started
+    long failed;							// batches that failed (or couldn't be started)
+    int quiet;								// don't show failures (-S)
+};
+
+/*
+ * This function sets up a hook. The batch's buffers are sized once, here, for the largest batch,
+ * so collecting paths costs no allocations. Returns 0 on success, -1 if there's not enough memory (ENOMEM),
+ * or the environment leaves no room on a command line for any paths at all (E2BIG)
+ */
+int hook_init(struct change_hook *hook, const char *command, int quiet) {
+    memset(hook, 0, sizeof(*hook));
+    hook->quiet = quiet;
+    size_t script_len = strlen(command) + sizeof(" \"$@\"");
+    if (!(hook->script = malloc(script_len))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    snprintf(hook->script, script_len, "%s \"$@\"", command);
+
+    // A command line has to fit the environment, and the arguments before the paths (sh -c script rper, and
+    // the NULLs ending both lists), as well; and leaves some room spare, the same as xargs. That is all there is:
+    // a batch any bigger fails to start (E2BIG), so nothing in it would ever be run on
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t space = arg_max > 0 ? (size_t)arg_max : 4096;
+    size_t taken = sizeof("sh") + sizeof("-c") + script_len + sizeof("rper") + 6 * sizeof(char *) + 2048;
+    for (char **env = environ; *env; env++) {
+        taken += strlen(*env) + 1 + sizeof(char *);
+    }
+    size_t limit = space > taken ? space - taken : 0;
+    if (limit > HOOK_BATCH_MAX) {
+        limit = HOOK_BATCH_MAX;
+    }
+    if (limit == 0) {
+        errno = E2BIG;
+        return -1;
+    }
+    hook->limit = limit;
+    hook->buffer = malloc(hook->limit);
+    hook->max_args = hook->limit / (1 + sizeof(char *)) + 1;	// the most paths (one character each) that fit
+    hook->argv = malloc((hook->max_args + 5) * sizeof(char *));
+    if (!hook->buffer || !hook->argv) {
+        errno = ENOMEM;
+        return -1;
+    }
+    hook->argv[0] = "sh";
+    hook->argv[1] = "-c";
+    hook->argv[2] = hook->script;
+    hook->argv[3] = "rper";					// $0, for the shell's own error messages
+    return 0;
+}
+
+/*
+ * This function collects what has finished of the batches running; waiting for the oldest first, if wait is set
+ */
+void hook_reap(struct change_hook *hook, int wait) {
+    for (int i = 0; i < hook->nrunning;) {
+        int status;
+        pid_t pid = waitpid(hook->running[i], &status, wait && i == 0 ? 0 : WNOHANG);
+        if (pid == 0 || (pid < 0 && errno == EINTR)) {
+            i++;								// still running
+            continue;
+        }
+        if (pid > 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            hook->failed++;
+            if (!hook->quiet) {
+                if (WIFEXITED(status)) {
+                    fprintf(stderr, "Error: --on-change command failed (exit status %d)\n", WEXITSTATUS(status));
+                } else {
+                    fprintf(stderr, "Error: --on-change command failed (signal %d)\n", WTERMSIG(status));
+                }
+            }
+        }
+        memmove(&hook->running[i], &hook->running[i + 1], (hook->nrunning - i - 1) * sizeof(pid_t));
+        hook->nrunning--;
+    }
+}
+
+/*
+ * This function starts the command on the paths collected so far (if there are any), once there is a free slot for it
+ */
+void hook_flush(struct change_hook *hook) {
+    hook_reap(hook, 0);
+    if (hook->nargs == 0) {
+        return;
+    }
+    while (hook->nrunning == HOOK_PROCESSES) {
+        hook_reap(hook, 1);						// the oldest has probably been going longest
+    }
+
+    hook->argv[4 + hook->nargs] = NULL;
+    pid_t pid;
+    int error = posix_spawn(&pid, "/bin/sh", NULL, NULL, hook->argv, environ);
+    if (error == 0) {
+        hook->running[hook->nrunning++] = pid;
+    } else {
+        hook->failed++;
+        if (!hook->quiet) {
+            fprintf(stderr, "Error: Cannot run --on-change command: %s\n", strerror(error));
+        }
+    }
+    hook->batches++;
+    hook->nargs = 0;
+    hook->used = 0;
+}
+
+/*
+ * This function adds a changed entry's path to the batch, starting the batch first if the path wouldn't fit.
+ * A path that wouldn't fit even on its own (a big environment leaves little room) is reported as a failure,
+ * rather than run in a batch that can't start.
+ */
+void hook_add(struct change_hook *hook, const char *path) {
+    size_t len = strlen(path) + 1;
+    size_t cost = len + sizeof(char *);		// the string and its pointer, as the kernel counts them
+    if (cost > hook->limit) {
+        hook->failed++;
+        if (!hook->quiet) {
+            fprintf(stderr, "Error: Cannot run --on-change command on %s: %s\n", path, strerror(E2BIG));
+        }
+        return;
+    }
+    if (hook->used + cost > hook->limit || hook->nargs == hook->max_args) {
+        hook_flush(hook);
+    }
+    // Paths are laid out one after another; the buffer is at least as big as limit, which counts more than the strings
+    char *copy = hook->buffer + (hook->used - hook->nargs * sizeof(char *));
+    memcpy(copy, path, len);
+    hook->argv[4 + hook->nargs++] = copy;
+    hook->used += cost;
+}
+
+/*
+ * This function runs what's left of the batch, and waits for every batch still running
+ */
+void hook_finish(struct change_hook *hook) {
+    hook_flush(hook);
+    while (hook->nrunning > 0) {
+        hook_reap(hook, 1);
+    }
+}
+
+void hook_free(struct change_hook *hook) {
+    free(hook->script);
+    free(hook->buffer);
+    free(hook->argv);
+}
+
+/*
+ * This function is the job's callback; it prints each change, skip and error
+ * following the output flags (-s, -S, -v)
+ */
+void print_event(const struct rper_job *job, const struct rper_event *event, void *user) {
+    struct output_options *out = user;
+    (void)job;									// everything needed is in the event
+    if (out->hook && event->type == RPER_CHANGED) {
+        hook_add(out->hook, rper_event_path(event));	// whatever is shown, the hook hears about every change
+    }
+    if (out->suppress_output || out->suppress_all_output) {
+        return;									// errors included, for both suppressing flags
+    }
+
+    switch (event->type) {
+        case RPER_SKIPPED:
+            if (out->watching) {
+                break;							// when watching, rper hears about its own changes too; no need to repeat them
+            }
+            format_print(out->stream, out->skipped ? out->skipped : &format_skipped, event);	// outputs D -> S, or F -> S
+            break;
+        case RPER_CHANGED:
+            format_print(out->stream, out->changed ? out->changed : &format_changed, event);	// old mode, mode given, new mode
+            break;
+        case RPER_COPY_UP_AVOIDED:
+            format_print(out->stream, out->skipped ? out->skipped : &format_copy_up_avoided, event);	// outputs D -> O, or F -> O
+            break;
+        case RPER_ERROR:
+            fprintf(out->errors, "Error: Cannot %s %s: %s\n", event->failed, rper_event_path(event), strerror(event->error));
+            break;
+    }
+}
+
+/*
+ * This function prints what a sample (--sample) says about the whole directory; the fraction
+ * of entries that would change, with a 95% confidence interval (Wilson score interval),
+ * and the same as a number of entries
+ */
+void print_sample_estimate(const struct rper_job *job, FILE *stream) {
+    double n = job->entries_sampled;
+    double found = job->files_changed + job->dirs_changed;
+    fprintf(stream, "Sample completed.\n");
+    fprintf(stream, "Entries: %ld (sampled: %ld)\n", job->entries_seen, job->entries_sampled);
+    fprintf(stream, "Sampled entries to change: %.0f\n", found);
+    if (n == 0) {
+        fprintf(stream, "Estimated to change: unknown (nothing sampled)\n");
+        return;
+    }
+
+    double z = 1.96;							// 95% confidence
+    double p = found / n;
+    double centre = (p + z * z / (2 * n)) / (1 + z * z / n);
+    double spread = z * sqrt(p * (1 - p) / n + z * z / (4 * n * n)) / (1 + z * z / n);
+    double low = centre - spread < 0 ? 0 : centre - spread;
+    double high = centre + spread > 1 ? 1 : centre + spread;
+    fprintf(stream, "Estimated to change: %.2f%% (95%% confidence: %.2f%% - %.2f%%), about %.0f entries (%.0f - %.0f)\n",
+            p * 100, low * 100, high * 100, p * job->entries_seen, low * job->entries_seen, high * job->entries_seen);
+}
+
+/*
+ * This function prints an estimate (--estimate); what was found, and how long a full run would take.
+ * A full run reads every directory (as the estimate did), and stats every entry of the selected types;
+ * each stat is taken to cost what the timed ones did. The chmods aren't counted, as they depend
+ * on how much needs changing.
+ */
+void print_estimate(const struct rper_job *job, FILE *stream, double elapsed, double max_ops) {
+    const struct rper_estimate *estimate = job->estimate;
+    long stats = (job->change_files || job->report_all ? estimate->files : 0) +
+                 (job->change_dirs || job->report_all ? estimate->dirs : 0);
+    double stat_cost = estimate->stats_timed ? estimate->stat_seconds / estimate->stats_timed : 0;
+    double reading = elapsed - estimate->stat_seconds;
+    double projected = reading + stats * stat_cost;
+    if (max_ops > 0 && projected < (stats + estimate->dirs) / max_ops) {
+        projected = (stats + estimate->dirs) / max_ops;	// --max-ops is the limit then
+    }
+
+    fprintf(stream, "Estimate completed.\n");
+    fprintf(stream, "Entries: %ld (files: %ld, directories: %ld)\n", estimate->entries, estimate->files, estimate->dirs);
+    fprintf(stream, "Deepest directory: %d levels down\n", estimate->max_depth);
+    fprintf(stream, "Largest directories:\n");
+    for (int i = 0; i < estimate->nlargest; i++) {
+        fprintf(stream, "  %10ld  %s\n", estimate->largest[i].entries, estimate->largest[i].path);
+    }
+    fprintf(stream, "Time per stat: %.1fus (from %ld timed)\n", stat_cost * 1e6, estimate->stats_timed);
+    fprintf(stream, "Estimated run time: %.2fs (reading directories %.2fs, %ld stats %.2fs, not counting chmods)\n",
+            projected, reading, stats, stats * stat_cost);
+}
+
+/*
+ * This function prints the final completion summary unless all output is suppressed
+ */
+void print_summary(const struct rper_job *job, const struct output_options *out) {
+    if (out->suppress_all_output) {
+        return;
+    }
+    if (job->sample_rate > 0) {
+        print_sample_estimate(job, out->stream);
+    } else if (job->check) {
+        fprintf(out->stream, "Check completed.\n");
+        fprintf(out->stream, "Files to change: %ld\n", job->files_changed);
+        fprintf(out->stream, "Directories to change: %ld\n", job->dirs_changed);
+    } else {
+        fprintf(out->stream, "Operation completed.\n");
+        fprintf(out->stream, "Files changed: %ld\n", job->files_changed);
+        fprintf(out->stream, "Directories changed: %ld\n", job->dirs_changed);
+    }
+    if (job->nabandoned) {
+        fprintf(out->stream, "Abandoned (timed out), to be retried: %d\n", job->nabandoned);
+        for (int i = 0; i < job->nabandoned; i++) {
+            fprintf(out->stream, "  %s\n", job->abandoned[i]);
+        }
+    }
+    if (out->hook) {
+        fprintf(out->stream, "On-change batches run: %ld (failed: %ld)\n", out->hook->batches, out->hook->failed);
+    }
+    if (job->copy_ups || job->copy_ups_avoided) {
+        fprintf(out->stream, "%s from overlay lower layers: %ld (%.1f MiB of data)\n", job->check ? "To copy up" : "Copied up",
+                job->copy_ups, job->copy_up_bytes / 1048576.0);
+        fprintf(out->stream, "Left alone (only in a lower layer): %ld\n", job->copy_ups_avoided);
+    }
+    if (job->verify) {
+        fprintf(out->stream, "Verified: %ld (mismatches: %d)\n", job->verified, job->nmismatches);
+        for (int i = 0; i < job->nmismatches; i++) {
+            const struct rper_mismatch *mismatch = &job->mismatches[i];
+            fprintf(out->stream, "  %s (expected %s, found %s)\n", mismatch->path,
+                    format_octal[mismatch->expected], format_octal[mismatch->found]);
+        }
+        if (job->nunverified) {
+            fprintf(out->stream, "Changed, not verified (read back timed out): %d\n", job->nunverified);
+            for (int i = 0; i < job->nunverified; i++) {
+                fprintf(out->stream, "  %s\n", job->unverified[i]);
+            }
+        }
+    }
+}
+
+/*
+ * This function prints one line of the histogram for each permissions found; subtree, type, mode and count
+ */
+void print_mode_counts(FILE *stream, const char *subtree, const struct rper_mode_counts *counts) {
+    for (int mode = 0; mode < 512; mode++) {
+        if (counts->files[mode]) {
+            fprintf(stream, "%s\tF\t%03o\t%ld\n", subtree, mode, counts->files[mode]);
+        }
+    }
+    for (int mode = 0; mode < 512; mode++) {
+        if (counts->dirs[mode]) {
+            fprintf(stream, "%s\tD\t%03o\t%ld\n", subtree, mode, counts->dirs[mode]);
+        }
+    }
+}
+
+/*
+ * This function prints the histogram (--histogram); all of the directory first, then each top-level subtree
+ */
+void print_histogram(const struct rper_histogram *histogram, FILE *stream) {
+    fprintf(stream, "Permissions found (subtree, type, mode, count):\n");
+    print_mode_counts(stream, "(all)", &histogram->total);
+    for (int i = 0; i < histogram->nsubtrees; i++) {
+        print_mode_counts(stream, histogram->subtrees[i].name, histogram->subtrees[i].counts);
+    }
+}
+
+/*
+ * This function reads a --overlay setting: 'count', 'skip', or 'cap:SIZE' (bytes, or with K, M, G or T).
+ * Returns 0 on success, -1 (with an error printed) if it isn't valid
+ */
+int parse_overlay(const char *arg, struct rper_job *job) {
+    if (strcmp(arg, "count") == 0) {
+        job->overlay = RPER_OVERLAY_COUNT;
+        return 0;
+    }
+    if (strcmp(arg, "skip") == 0) {
+        job->overlay = RPER_OVERLAY_SKIP;
+        return 0;
+    }
+    if (strncmp(arg, "cap:", 4) == 0) {
+        char *end;
+        double size = strtod(arg + 4, &end);
+        const char *units = "KMGT";
+        const char *unit = *end ? strchr(units, *end) : NULL;
+        if (unit) {
+            for (int i = 0; i <= unit - units; i++) {
+                size *= 1024;
+            }
+            end++;
+        }
+        if (end != arg + 4 && !*end && size >= 0) {
+            job->overlay = RPER_OVERLAY_CAP;
+            job->overlay_cap = size;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: Invalid --overlay setting: %s (count, skip, or cap:SIZE, eg. cap:500M)\n\n", arg);
+    print_usage();
+    return -1;
+}
+
+/*
+ * This function validates the octal mode input by the user. It also handles cases
+ * where wildcards (*) are used and ensures the octal value is valid.
+ */
+int validate_and_process_octal(char *optarg, struct rper_mode *mode) {
+    if (rper_compile_mode(optarg, mode) != 0) {
+        fprintf(stderr, "Error: Invalid octal value: %s (google: unix octal permissions)\n\n", optarg);
+        print_usage();
+        return -1;
+    }
+    return 0;
+}
+
+/* Comparing fingerprints (--compare) */
+
+/*
+ * A fingerprint file, read back in; its directories, each linked to the ones in it,
+ * and a hash table to find them by path (open addressing, so just indexes into dirs)
+ */
+struct fingerprint_dir {
+    unsigned long long subtree;
+    unsigned long long local;
+    char *path;								// as written, escapes and all; a name never has a '/' in it
+    int first_child;						// the directories in it, as indexes into dirs (-1 for none)
+    int next_sibling;
+};
+
+struct fingerprints {
+    const char *file;
+    struct fingerprint_dir *dirs;
+    int ndirs;
+    int capacity;
+    int *table;								// indexes into dirs, -1 where empty
+    unsigned long table_size;				// a power of 2
+};
+
+/*
+ * This function gives the slot in the hash table to start looking for a path from
+ */
+unsigned long fingerprints_slot(const struct fingerprints *fps, const char *path, size_t len) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;	// FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+    }
+    return hash & (fps->table_size - 1);
+}
+
+/*
+ * This function finds a directory by its path. Returns its index, or -1 if it isn't there
+ */
+int fingerprints_find(const struct fingerprints *fps, const char *path, size_t len) {
+    // The table is never more than half full, so there is always an empty slot to stop at
+    for (unsigned long slot = fingerprints_slot(fps, path, len);; slot = (slot + 1) & (fps->table_size - 1)) {
+        int i = fps->table[slot];
+        if (i < 0) {
+            return -1;
+        }
+        if (strncmp(fps->dirs[i].path, path, len) == 0 && fps->dirs[i].path[len] == '\0') {
+            return i;
+        }
+    }
+}
+
+/*
+ * This function reads a fingerprint file (see --fingerprint), and links each directory to the one it is in.
+ * Returns 0 on success, -1 (with an error printed) if it can't be read, or isn't a fingerprint file
+ */
+int fingerprints_load(struct fingerprints *fps, const char *file) {
+    memset(fps, 0, sizeof(*fps));
+    fps->file = file;
+    FILE *in = fopen(file, "r");
+    if (!in) {
+        fprintf(stderr, "Error: Cannot read fingerprints from %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    long lineno = 0;
+    while ((len = getline(&line, &size, in)) != -1) {
+        lineno++;
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        struct fingerprint_dir dir = {0, 0, NULL, -1, -1};
+        int path_start = 0;
+        if (sscanf(line, "%16llx %16llx %n", &dir.subtree, &dir.local, &path_start) != 2 || path_start == 0 ||
+                line[path_start] != '.') {
+            fprintf(stderr, "Error: %s, line %ld: not a fingerprint\n", file, lineno);
+            break;
+        }
+        if (fps->ndirs == fps->capacity) {
+            int capacity = fps->capacity * 2 + 64;
+            struct fingerprint_dir *dirs = realloc(fps->dirs, capacity * sizeof(*dirs));
+            if (!dirs) {
+                fprintf(stderr, "Error: %s: %s\n", file, strerror(ENOMEM));
+                break;
+            }
+            fps->dirs = dirs;
+            fps->capacity = capacity;
+        }
+        if (!(dir.path = strdup(line + path_start))) {
+            fprintf(stderr, "Error: %s: %s\n", file, strerror(ENOMEM));
+            break;
+        }
+        fps->dirs[fps->ndirs++] = dir;
+    }
+    int failed = !feof(in);
+    free(line);
+    fclose(in);
+    if (failed) {
+        return -1;
+    }
+
+    // Hash every path, at most half full
+    fps->table_size = 16;
+    while (fps->table_size < 2UL * fps->ndirs) {
+        fps->table_size *= 2;
+    }
+    if (!(fps->table = malloc(fps->table_size * sizeof(*fps->table)))) {
+        fprintf(stderr, "Error: %s: %s\n", file, strerror(ENOMEM));
+        return -1;
+    }
+    memset(fps->table, -1, fps->table_size * sizeof(*fps->table));
+    for (int i = 0; i < fps->ndirs; i++) {
+        unsigned long slot = fingerprints_slot(fps, fps->dirs[i].path, strlen(fps->dirs[i].path));
+        while (fps->table[slot] >= 0) {
+            slot = (slot + 1) & (fps->table_size - 1);
+        }
+        fps->table[slot] = i;
+    }
+
+    // Then link each directory into the one it is in (everything but "." is in one)
+    for (int i = 0; i < fps->ndirs; i++) {
+        const char *slash = strrchr(fps->dirs[i].path, '/');
+        int parent = slash ? fingerprints_find(fps, fps->dirs[i].path, slash - fps->dirs[i].path) : -1;
+        if (parent >= 0) {
+            fps->dirs[i].next_sibling = fps->dirs[parent].first_child;
+            fps->dirs[parent].first_child = i;
+        }
+    }
+    return 0;
+}
+
+void fingerprints_free(struct fingerprints *fps) {
+    for (int i = 0; i < fps->ndirs; i++) {
+        free(fps->dirs[i].path);
+    }
+    free(fps->dirs);
+    free(fps->table);
+}
+
+/*
+ * This function compares a directory in two fingerprint files; where the subtree hashes are the same, so is
+ * everything below, and that's as far as it goes. Otherwise it reports the directory if its own entries differ,
+ * and goes on into the directories in it. Returns the count of differences reported.
+ */
+long compare_directory(const struct fingerprints *a, int ia, const struct fingerprints *b, int ib,
+                       const struct output_options *out, long *compared) {
+    (*compared)++;
+    if (a->dirs[ia].subtree == b->dirs[ib].subtree) {
+        return 0;
+    }
+    long differences = 0;
+    if (a->dirs[ia].local != b->dirs[ib].local) {
+        if (!out->suppress_output && !out->suppress_all_output) {
+            fprintf(out->stream, "Differs: %s\n", a->dirs[ia].path);
+        }
+        differences++;
+    }
+    for (int child = a->dirs[ia].first_child; child >= 0; child = a->dirs[child].next_sibling) {
+        const char *path = a->dirs[child].path;
+        int other = fingerprints_find(b, path, strlen(path));
+        if (other >= 0) {
+            differences += compare_directory(a, child, b, other, out, compared);
+        } else {
+            if (!out->suppress_output && !out->suppress_all_output) {
+                fprintf(out->stream, "Only in %s: %s\n", a->file, path);
+            }
+            differences++;
+        }
+    }
+    for (int child = b->dirs[ib].first_child; child >= 0; child = b->dirs[child].next_sibling) {
+        const char *path = b->dirs[child].path;
+        if (fingerprints_find(a, path, strlen(path)) < 0) {
+            if (!out->suppress_output && !out->suppress_all_output) {
+                fprintf(out->stream, "Only in %s: %s\n", b->file, path);
+            }
+            differences++;
+        }
+    }
+    return differences;
+}
+
+/*
+ * This function reads just the subtree hash of the directory itself from a fingerprint file; its line is always
+ * the last (a directory's line is written once everything in it is done). Returns 0, or -1 if it can't be found.
+ */
+#define FINGERPRINT_TAIL 256					// bytes read from the end of the file; the last line is much shorter
+
+int fingerprints_root(const char *file, unsigned long long *subtree) {
+    FILE *in = fopen(file, "r");
+    char tail[FINGERPRINT_TAIL + 1];
+    if (!in) {
+        return -1;
+    }
+    size_t len = 0;
+    if (fseek(in, 0, SEEK_END) == 0) {
+        long size = ftell(in);
+        long start = size > FINGERPRINT_TAIL ? size - FINGERPRINT_TAIL : 0;
+        if (size >= 0 && fseek(in, start, SEEK_SET) == 0) {
+            len = fread(tail, 1, FINGERPRINT_TAIL, in);
+        }
+    }
+    fclose(in);
+    tail[len] = '\0';
+    if (len > 0 && tail[len - 1] == '\n') {
+        tail[--len] = '\0';
+    }
+    char *line = strrchr(tail, '\n');
+    line = line ? line + 1 : tail;
+    unsigned long long local;
+    int path_start = 0;
+    if (sscanf(line, "%16llx %16llx %n", subtree, &local, &path_start) != 2 || path_start == 0 ||
+            strcmp(line + path_start, ".") != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * This function compares two fingerprint files (--compare). If the directories' own subtree hashes (the last line
+ * of each) are the same, so is everything, and nothing more is read; the usual case for replicas. Otherwise both
+ * files are read in full (that much is down to how big the trees are), and only the subtrees that differ are gone into.
+ * Returns EXIT_SUCCESS if they are the same, otherwise EXIT_FAILURE (as with --check)
+ */
+int run_compare(const char *file_a, const char *file_b, const struct output_options *out) {
+    unsigned long long root_hash_a, root_hash_b;
+    if (fingerprints_root(file_a, &root_hash_a) == 0 && fingerprints_root(file_b, &root_hash_b) == 0 &&
+            root_hash_a == root_hash_b) {
+        if (!out->suppress_all_output) {
+            fprintf(out->stream, "Compare completed.\n");
+            fprintf(out->stream, "Directories compared: 1 (the same all the way down)\n");
+            fprintf(out->stream, "Differences: 0\n");
+        }
+        return EXIT_SUCCESS;
+    }
+
+    struct fingerprints a, b;
+    if (fingerprints_load(&a, file_a) != 0) {
+        fingerprints_free(&a);
+        return EXIT_FAILURE;
+    }
+    if (fingerprints_load(&b, file_b) != 0) {
+        fingerprints_free(&a);
+        fingerprints_free(&b);
+        return EXIT_FAILURE;
+    }
+
+    int root_a = fingerprints_find(&a, ".", 1);
+    int root_b = fingerprints_find(&b, ".", 1);
+    long differences = 0, compared = 0;
+    int result = EXIT_FAILURE;
+    if (root_a < 0 || root_b < 0) {
+        fprintf(stderr, "Error: No fingerprint for the directory itself (\".\") in %s\n", root_a < 0 ? file_a : file_b);
+    } else {
+        differences = compare_directory(&a, root_a, &b, root_b, out, &compared);
+        if (!out->suppress_all_output) {
+            fprintf(out->stream, "Compare completed.\n");
+            fprintf(out->stream, "Directories compared: %ld (of %d and %d)\n", compared, a.ndirs, b.ndirs);
+            fprintf(out->stream, "Differences: %ld\n", differences);
+        }
+        result = differences ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    fingerprints_free(&a);
+    fingerprints_free(&b);
+    return result;
+}
+
+/* Metrics (--stats-file, --prom-file) */
+/*
+ * Two ways to watch a long run from outside. --stats-file maps a file into memory and has the job keep its
+ * metrics right there (a struct stats_file; anything that maps or reads the file sees them as they change).
+ * --prom-file is rewritten every METRICS_INTERVAL seconds by a thread of its own, in Prometheus' text format,
+ * for node_exporter's textfile collector; written to a temporary file, then renamed, so it's never seen half written.
+ */
+#define METRICS_INTERVAL 5						// seconds between rewrites of the Prometheus file
+#define STATS_FILE_MAGIC "RPERSTAT"
+#define STATS_FILE_VERSION 1
+
+struct stats_file {
+    char magic[8];							// STATS_FILE_MAGIC (no terminating '\0')
+    unsigned int version;					// STATS_FILE_VERSION
+    unsigned int size;						// sizeof(struct stats_file), as written
+    long pid;								// the rper writing it
+    long started;							// when it started (seconds since the epoch)
+    long finished;							// when it finished, 0 while still running
+    struct rper_metrics metrics;			// native byte order and sizes
+};
+
+/*
+ * This function maps the stats file (creating it, or replacing what was there).
+ * Returns the mapping, or NULL (with an error printed) if it can't be made
+ */
+struct stats_file *stats_file_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(struct stats_file)) != 0) {
+        fprintf(stderr, "Error: Cannot create stats file %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    struct stats_file *stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);									// the mapping keeps the file
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map stats file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    stats->version = STATS_FILE_VERSION;
+    stats->size = sizeof(*stats);
+    stats->pid = getpid();
+    stats->started = time(NULL);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(stats->magic, STATS_FILE_MAGIC, sizeof(stats->magic));	// last; once it's there, so is the rest
+    return stats;
+}
+
+/*
+ * This function marks the stats file finished, and unmaps it
+ */
+void stats_file_close(struct stats_file *stats) {
+    __atomic_store_n(&stats->finished, (long)time(NULL), __ATOMIC_RELEASE);
+    munmap(stats, sizeof(*stats));
+}
+
+struct metrics_reporter {
+    const struct rper_metrics *metrics;
+    const char *prom_file;
+    char tmp_file[PATH_MAX];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;					// signalled to stop
+    int stop;
+    unsigned long last_entries;				// entries, and when, at the last rewrite; for the rate
+    struct timespec last;
+};
+
+/*
+ * This function writes the Prometheus file; every counter as it is now, and the rate of entries since the last time.
+ * Returns 0 on success, -1 if it couldn't be written (errno says why)
+ */
+int metrics_write_prom(struct metrics_reporter *reporter) {
+    const struct rper_metrics *metrics = reporter->metrics;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long entries = __atomic_load_n(&metrics->entries, __ATOMIC_RELAXED);
+    double elapsed = (now.tv_sec - reporter->last.tv_sec) + (now.tv_nsec - reporter->last.tv_nsec) / 1e9;
+    double rate = elapsed > 0 ? (entries - reporter->last_entries) / elapsed : 0;
+    reporter->last_entries = entries;
+    reporter->last = now;
+
+    FILE *out = fopen(reporter->tmp_file, "w");
+    if (!out) {
+        return -1;								// tried again next time
+    }
+    static const struct { const char *name, *type, *help; size_t offset; } counters[] = {
+        {"rper_entries_total", "counter", "Entries found", offsetof(struct rper_metrics, entries)},
+        {"rper_directories_total", "counter", "Directories opened", offsetof(struct rper_metrics, dirs)},
+        {"rper_files_changed_total", "counter", "Files changed", offsetof(struct rper_metrics, files_changed)},
+        {"rper_directories_changed_total", "counter", "Directories changed", offsetof(struct rper_metrics, dirs_changed)},
+        {"rper_errors_total", "counter", "Errors reported", offsetof(struct rper_metrics, errors)},
+        {"rper_queue_depth", "gauge", "Directories open on the walk's stack, still to be finished", offsetof(struct rper_metrics, depth)},
+        {"rper_prefetch_queue", "gauge", "Directories waiting to be read by the prefetch", offsetof(struct rper_metrics, prefetch_queue)},
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        const unsigned long *value = (const unsigned long *)((const char *)metrics + counters[i].offset);
+        fprintf(out, "# HELP %s %s.\n# TYPE %s %s\n%s %lu\n", counters[i].name, counters[i].help,
+                counters[i].name, counters[i].type, counters[i].name, __atomic_load_n(value, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# HELP rper_entries_per_second Entries found per second, since the last update.\n");
+    fprintf(out, "# TYPE rper_entries_per_second gauge\nrper_entries_per_second %.1f\n", rate);
+
+    // The latency histogram; Prometheus' buckets count everything up to their bound, so the counts are added up
+    fprintf(out, "# HELP rper_operation_seconds Time taken by stats, chmods and directory opens.\n");
+    fprintf(out, "# TYPE rper_operation_seconds histogram\n");
+    unsigned long total = 0;
+    for (int i = 0; i < RPER_LATENCY_BUCKETS; i++) {
+        total += __atomic_load_n(&metrics->latency[i], __ATOMIC_RELAXED);
+        if (i < RPER_LATENCY_BUCKETS - 1) {
+            fprintf(out, "rper_operation_seconds_bucket{le=\"%.9g\"} %lu\n", (double)(1UL << i) / 1e6, total);
+        } else {
+            fprintf(out, "rper_operation_seconds_bucket{le=\"+Inf\"} %lu\n", total);
+        }
+    }
+    fprintf(out, "rper_operation_seconds_sum %.9f\n", __atomic_load_n(&metrics->op_nanoseconds, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "rper_operation_seconds_count %lu\n", total);
+
+    if (fclose(out) != 0 || rename(reporter->tmp_file, reporter->prom_file) != 0) {
+        int saved_errno = errno;
+        unlink(reporter->tmp_file);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The reporter thread; rewrites the Prometheus file every METRICS_INTERVAL seconds, until stopped
+ */
+void *metrics_reporter_run(void *arg) {
+    struct metrics_reporter *reporter = arg;
+    pthread_mutex_lock(&reporter->lock);
+    while (!reporter->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += METRICS_INTERVAL;
+        pthread_cond_timedwait(&reporter->wake, &reporter->lock, &deadline);
+        if (!reporter->stop) {
+            metrics_write_prom(reporter);
+        }
+    }
+    pthread_mutex_unlock(&reporter->lock);
+    return NULL;
+}
+
+/*
+ * This function writes the Prometheus file for the first time, and starts the thread keeping it up to date.
+ * Returns 0 on success, -1 (with an error printed) if it can't
+ */
+int metrics_reporter_start(struct metrics_reporter *reporter, const char *prom_file, const struct rper_metrics *metrics) {
+    memset(reporter, 0, sizeof(*reporter));
+    reporter->metrics = metrics;
+    reporter->prom_file = prom_file;
+    if (snprintf(reporter->tmp_file, sizeof(reporter->tmp_file), "%s.tmp", prom_file) >= (int)sizeof(reporter->tmp_file)) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", prom_file, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &reporter->last);
+    if (metrics_write_prom(reporter) != 0) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", prom_file, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&reporter->lock, NULL);
+    pthread_cond_init(&reporter->wake, NULL);
+    if (pthread_create(&reporter->thread, NULL, metrics_reporter_run, reporter) != 0) {
+        fprintf(stderr, "Error: Cannot start the metrics thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * This function stops the reporter thread, and writes the Prometheus file one last time, with the final counts
+ */
+void metrics_reporter_stop(struct metrics_reporter *reporter) {
+    pthread_mutex_lock(&reporter->lock);
+    reporter->stop = 1;
+    pthread_cond_signal(&reporter->wake);
+    pthread_mutex_unlock(&reporter->lock);
+    pthread_join(reporter->thread, NULL);
+    metrics_write_prom(reporter);
+}
+
+/*
+ * This function is called as rper finishes, with whichever of the stats file and the reporter it has
+ */
+void metrics_finish(struct stats_file *stats, struct metrics_reporter *reporter) {
+    if (reporter) {
+        metrics_reporter_stop(reporter);
+    }
+    if (stats) {
+        stats_file_close(stats);
+    }
+}
+
+/* Daemon mode (rperd) */
+/*
+ * 'rper --daemon <socket>' keeps running, with a pool of worker threads taking jobs over a Unix socket,
+ * so many small jobs don't each pay for starting rper, and all of them share one throttle (--max-ops).
+ * Each connection is one job. The client sends the job's arguments one per line, the same as they
+ * would be given on the command line (eg. '-d', '-p', '755', then one or more directories), ending
+ * with an empty line (or by closing its side of the connection). The job's output, errors included,
+ * is streamed back as it runs, finishing with the usual summary.
+ * eg. printf -- '-d\n-p\n755\n/srv/data\n\n' | socat - UNIX-CONNECT:/run/rperd.sock
+ */
+#define DAEMON_MAX_REQUEST 65536				// biggest request (all arguments together) a client can send
+#define DAEMON_REQUEST_TIMEOUT 10				// seconds a client has to send all of its request
+#define DAEMON_MAX_ARGS 256						// most arguments a request can have
+
+struct daemon_settings {
+    int listen_fd;							// the listening Unix socket
+    struct rper_throttle *throttle;			// shared by every job, NULL if there is no --max-ops
+    double op_timeout;						// given to every job, 0 if there is no --timeout
+};
+
+/*
+ * This function only lets in clients running as the same user as the daemon (or root), where the
+ * system can tell us who is connecting; elsewhere the socket's own permissions (0600) have to do.
+ */
+int daemon_client_allowed(int fd) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        return 0;
+    }
+    return cred.uid == 0 || cred.uid == geteuid();
+#else
+    (void)fd;
+    return 1;
+#endif
+}
+
+/*
+ * This function reads a job request from a client; its arguments, one per line, up to an empty line.
+ * The arguments point into the given buffer. Returns the number of arguments, or -1 on failure.
+ * A client gets DAEMON_REQUEST_TIMEOUT seconds for the whole request, however it sends it, so one that
+ * connects and never sends (or sends a byte at a time) can't keep a worker from the other clients.
+ */
+int read_request(int fd, char *buffer, size_t size, char **args, int max_args) {
+    size_t used = 0;
+    int nargs = 0;
+    struct timespec deadline, now;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += DAEMON_REQUEST_TIMEOUT;
+
+    // Read until the client sends an empty line, or stops sending
+    while (used < size - 1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining_ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        struct pollfd pending = {fd, POLLIN, 0};
+        int ready = remaining_ms > 0 ? poll(&pending, 1, (int)remaining_ms) : 0;
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+        ssize_t n = read(fd, buffer + used, size - 1 - used);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            break;								// the client has finished sending
+        }
+        used += n;
+        buffer[used] = '\0';
+        if (buffer[0] == '\n' || strstr(buffer, "\n\n")) {
+            break;								// an empty line ends the request
+        }
+    }
+    if (used == size - 1) {
+        return -1;								// too big
+    }
+    buffer[used] = '\0';
+
+    // Split it into lines, one argument each
+    char *line = buffer;
+    while (*line && *line != '\n' && nargs < max_args) {
+        char *end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        }
+        args[nargs++] = line;
+        if (!end) {
+            break;
+        }
+        line = end + 1;
+    }
+    return nargs;
+}
+
+/*
+ * This function runs a single client's job, writing all output back to the client.
+ * It understands the same job flags as the command line (-f, -d, -i, -n, -c, -s, -S, -v, -p mode).
+ */
+void run_request(int fd, struct daemon_settings *daemon) {
+    char buffer[DAEMON_MAX_REQUEST];
+    char *args[DAEMON_MAX_ARGS];
+    const char *roots[DAEMON_MAX_ARGS];		// directories to run the job over
+    int nroots = 0;
+    int perm_flag = 0;
+    struct rper_job job;
+    struct output_options out = {0};
+    FILE *client = fdopen(fd, "w");			// output goes straight back to the client
+    if (!client) {
+        close(fd);
+        return;
+    }
+    rper_job_init(&job);
+    job.throttle = daemon->throttle;
+    job.op_timeout = daemon->op_timeout;
+    out.stream = client;
+    out.errors = client;
+
+    int nargs = read_request(fd, buffer, sizeof(buffer), args, DAEMON_MAX_ARGS);
+    if (nargs < 0) {
+        fprintf(client, "Error: Cannot read request: %s\n", strerror(errno));
+        fclose(client);
+        return;
+    }
+
+    for (int i = 0; i < nargs; i++) {
+        char *arg = args[i];
+        if (arg[0] != '-') {
+            roots[nroots++] = arg;				// anything that isn't a flag is a directory
+            continue;
+        }
+        for (char *flag = arg + 1; *flag; flag++) {
+            switch (*flag) {
+                case 'd': job.change_dirs = 1; break;
+                case 'f': job.change_files = 1; break;
+                case 'i': job.include_dir = 1; break;
+                case 'n': job.recursive = 0; break;
+                case 'c': out.changed = &format_changed_rwx; break;
+                case 's': out.suppress_output = 1; out.suppress_all_output = 0; break;
+                case 'S': if (!out.suppress_output) out.suppress_all_output = 1; break;
+                case 'v': out.verbose = 1; out.suppress_output = 0; out.suppress_all_output = 0; break;
+                case 'p': {
+                    // the mode is either the rest of this argument (-p755), or the next one
+                    const char *value = flag[1] ? flag + 1 : (i + 1 < nargs ? args[++i] : "");
+                    if (rper_compile_mode(value, &job.mode) != 0) {
+                        fprintf(client, "Error: Invalid octal value: %s\n", value);
+                        fclose(client);
+                        return;
+                    }
+                    perm_flag = 1;
+                    flag += strlen(flag) - 1;		// the rest of this argument was the mode
+                    break;
+                }
+                default:
+                    fprintf(client, "Error: Unknown flag -%c\n", *flag);
+                    fclose(client);
+                    return;
+            }
+        }
+    }
+
+    if (!nroots || !perm_flag) {
+        fprintf(client, "Error: %s\n", !nroots ? "Missing directory argument" : "No permissions detected (use -p)");
+        fclose(client);
+        return;
+    }
+    if (!job.change_files && !job.change_dirs) {
+        job.change_files = 1;					// the same default as the command line
+    }
+    job.report_all = out.verbose;
+    if (!out.suppress_output && !out.suppress_all_output) {
+        job.on_event = print_event;
+        job.user = &out;
+    }
+
+    for (int i = 0; i < nroots; i++) {
+        rper_run(&job, roots[i]);
+    }
+
+    print_summary(&job, &out);
+    rper_job_free(&job);
+    fclose(client);							// also closes the connection
+}
+
+/*
+ * This function is a daemon worker; it takes one connection (job) at a time, for as long as the daemon runs
+ */
+void *daemon_worker(void *arg) {
+    struct daemon_settings *daemon = arg;
+    for (;;) {
+        int fd = accept(daemon->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                sleep(1);						// eg. out of file descriptors; give the other jobs a chance to finish
+            }
+            continue;
+        }
+        if (!daemon_client_allowed(fd)) {
+            close(fd);
+            continue;
+        }
+        run_request(fd, daemon);
+    }
+    return NULL;
+}
+
+/*
+ * This function runs rper as a daemon, listening on the given Unix socket; it only returns on failure
+ */
+int run_daemon(const char *socket_path, int workers, double max_ops, double op_timeout) {
+    struct sockaddr_un addr = {0};
+    struct daemon_settings daemon = {0};
+    struct rper_throttle throttle;
+    struct stat statbuf;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path is too long: %s\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    signal(SIGPIPE, SIG_IGN);					// a client going away shouldn't take the daemon with it
 
-    permissions (-p):
-    - uses an octal formatted argument (eg. 755 or 0644) as the desired changed permissions.
-    - allows the use of (*) as a wildcard, eg 6*4 will change the user (left-most), and others (right-most) permissions, but not the group(center) permission
-    
-    help (-h | -H):
-    - displays help for the user
-    
-    about (-a):
-    - displays information about rper
+    // A socket left behind by a previous daemon would stop us binding; anything else is left alone
+    if (lstat(socket_path, &statbuf) == 0 && S_ISSOCK(statbuf.st_mode)) {
+        unlink(socket_path);
+    }
 
-C Language notes:
-- strings are in the form of arrays; C doesn't really have 'strings' like other languages
-	so each character is a position in an array
-- mode_t is a data type used to represent file modes or file permissions, originally defined in <sys/types.h>
-    - read -> 4, write -> 2, execute -> 1
-    - user <rwx>, group <rwx>, others <rwx>
-    - eg. rwxrw-r-x -> 4+2+1(7), 4+2(6), 4+1(5) -> 765
-*/
+    daemon.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon.listen_fd < 0) {
+        fprintf(stderr, "Error: Cannot create socket: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    mode_t old_umask = umask(077);				// the socket is only usable by our own user (0600)
+    int bound = bind(daemon.listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (bound != 0 || listen(daemon.listen_fd, 64) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        close(daemon.listen_fd);
+        return EXIT_FAILURE;
+    }
 
-#include <stdio.h>              // Standard Input/Output Library, for input and output functions (like printf, fprintf)
-#include <stdlib.h>             // General Purpose Standard Library, for standard library functions (like exit, malloc, etc.)
-#include <string.h>             // used not only for string handling, but various memory handling functions (like strlen, strcpy, etc.)
-#include <dirent.h>             // constructs that facilitate directory traversing, for reading directories (opendir, readdir, closedir)
-#include <sys/stat.h>           // contains constructs that facilitate getting information about files attributes, (chmod, stat)
-#include <unistd.h>             // provides access to the POSIX operating system API, for POSIX API functions (like getopt)
-#include <errno.h>              // macros to report error conditions through error codes stored in 'errno' (provides errno and strerror)
+    if (max_ops > 0) {
+        rper_throttle_init(&throttle, max_ops);
+        daemon.throttle = &throttle;
+    }
+    daemon.op_timeout = op_timeout;
 
-/* Global flags */
-// Variables required in multiple functions, not just the main function
-char version[4] = "0.1";					// version number, as a string (array)
-int files_changed = 0;						// Count of files changed
-int dirs_changed = 0;						// Count of directories changed
-int suppress_output = 0;					// suppress normal output, suppress all output except errors and completion
-int suppress_all_output = 0;				// suppress all output, suppress everything except completion output
-int verbose = 0;							// verbose switch, prints all output, even skipped directories/files
-char wildcard_mode[4] = {0};				// Stores the octal mode with wildcards (e.g., '6*4')
+    printf("rperd listening on %s (%d workers)\n", socket_path, workers);
+    fflush(stdout);
+
+    // Start the pool; this thread becomes the last worker
+    for (int i = 1; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, daemon_worker, &daemon) != 0) {
+            fprintf(stderr, "Error: Cannot start worker: %s\n", strerror(errno));
+            break;
+        }
+        pthread_detach(thread);
+    }
+    daemon_worker(&daemon);
+    return EXIT_SUCCESS;
+}
 
-/* Functions */
+/* Watch mode */
 /*
- * This function prints some basic infoirmation to guide the user while using rper.
- * The expectation is that this function will fire, 
- * if using any of the help flags [h | H], or if rper returns an error.
+ * 'rper --watch' does one normal pass over the directory, then keeps running, and only looks at
+ * entries that are created, moved in, or have their attributes changed, instead of re-walking
+ * the whole tree to find a few new files. When run as root, fanotify watches the whole filesystem
+ * (and any mounted inside the directory) with a handful of marks; otherwise every directory gets
+ * an inotify watch. If the kernel drops events (its queue overflowed), the whole directory is rescanned.
  */
-void print_usage() {
-    printf("Usage: rper [-f | -d] [-i]  [-n] [-s | -S] [-p mode] [-h | -H] <directory>\n");
-    printf("  -f : Search files only (default function if no flags are provided)\n");
-    printf("  -d : Search directories only (can be used with -f flag)\n");
-    printf("  -i : Include the given directory in the changes (with -d flag only)\n");
-    printf("  -n : Do not apply changes recursively (changes only affect specified directory)\n");
-    printf("  -s : Suppress normal output, only show errors\n");
-    printf("  -S : Suppress all output, including errors\n");
-    printf("  -p : Specify permissions in octal format (e.g., 755, 0644)\n");
-    printf("  -h, -H: Display this help message\n");
-}
+#ifdef __linux__
+#define WATCH_BUFFER 65536						// events read from the kernel at a time
+
+struct watch_state {
+    struct rper_job *job;
+    struct output_options *out;
+    const char *root;						// the directory being watched, as given
+    char **paths;							// inotify only; the path of each watched directory, by watch descriptor
+    int npaths;
+};
 
 /*
- * This function prints some basic 'about' information, regarding rper 
+ * This function handles one created/moved/changed entry; new directories are processed all the way down
  */
-void print_about() {
-    printf("rper (pronounced: 'arr per'). version: %s\n", version);
-    printf("Author: Dale Hitchenor");
-    printf("Source: https://github.com/dhitchenor/rper");
+void watch_entry(struct watch_state *watch, const char *path, int is_new) {
+    rper_apply(watch->job, path, is_new);
+    fflush(watch->out->stream);					// changes are shown as they happen, even when output goes to a file
 }
+
 /*
- * This function prints the current permissions of a file/directory in octal format.
- * It uses bitwise operations to extract the permission bits from the mode.
+ * This function is called once each lot of events read from the kernel has been handled;
+ * what they changed is given to the hook (--on-change) straight away, rather than waiting for a full batch
  */
-void print_permissions(mode_t mode) {			// prints the given mode, properly formatted for rper
-    printf("%o", mode & 0777);
+void watch_flush(struct watch_state *watch) {
+    if (watch->out->hook) {
+        hook_flush(watch->out->hook);
+    }
 }
 
 /*
- * This function applies the wildcard mode (e.g., '6*4') to the current permissions.
- * The wildcard '*' means that the corresponding permission part is not changed.
+ * This function puts together the path of an entry in a watched directory. Returns 0 on success, or -1 (having
+ * reported it) if it doesn't fit; the entry is left alone, rather than something at a truncated path changed instead
  */
-mode_t apply_wildcard_mode(mode_t old_mode) {
-    mode_t new_mode = old_mode & 0777;			// Get current permissions in octal (last 3 digits)
-												// found in the sys/stat.h header file, used widely by chmod
-	// Iterate through each part (user, group, others) and apply the wildcard
-	for (int i = 0; i < 3; i++) {
-        if (wildcard_mode[i] != '*') {			// loop through each of the bits, in the given octal
-            new_mode &= ~(7 << (6 - 3 * i));	// clear the relevant bits
-            new_mode |= (wildcard_mode[i] - '0') << (6 - 3 * i);    // set the new bits, which will make the new mode
-        }
+int watch_path(struct watch_state *watch, char *path, size_t size, const char *dir_path, const char *name) {
+    if ((size_t)snprintf(path, size, "%s/%s", dir_path, name) < size) {
+        return 0;
     }
-
-    return new_mode;			// Return the new permission mode
+    if (!watch->out->suppress_output && !watch->out->suppress_all_output) {
+        fprintf(watch->out->errors, "Error: Cannot watch %s/%s: %s\n", dir_path, name, strerror(ENAMETOOLONG));
+    }
+    return -1;
 }
 
 /*
- * This function prints the wildcard mode (e.g., '6*4'), showing the parts that are
- * not being changed due to the wildcard '*'.
+ * This function deals with the kernel having dropped events. Nothing says which directories they were in,
+ * so the whole directory is rescanned (not just part of it), which is the only way to be sure nothing was
+ * missed; entries that are already right cost a stat each, and are left alone
  */
-void print_wildcard_mode() {
-    for (int i = 0; i < 3; i++) {
-        if (wildcard_mode[i] != '*') {
-            printf("%c", wildcard_mode[i]); 	// Print the actual value
-        } else {
-            printf("*");						// Print '*' for wildcard
-        }
+void watch_rescan(struct watch_state *watch) {
+    if (!watch->out->suppress_all_output) {
+        fprintf(watch->out->errors, "Warning: Too many changes at once, rescanning %s\n", watch->root);
     }
+    rper_run(watch->job, watch->root);
 }
 
 /*
- * This function changes the permissions of a given file/directory.
- * It handles both files and directories and outputs the changes made.
+ * This function adds an inotify watch for one directory. Adding a watch for a directory that already has one
+ * (eg. it was moved) just updates its path. Returns 0 on success, otherwise -1 (having reported it).
  */
-void change_permissions(const char *path, mode_t mode, int change_files, int change_dirs) {
-    struct stat statbuf;						// Structure to hold information about the file/directory
-    // Get the status of the file/directory (its type, permissions, etc.)
-	if (lstat(path, &statbuf) != 0) {
-        if (!suppress_output && !suppress_all_output) {
-            fprintf(stderr, "Error: Cannot access(stat) file %s: %s\n", path, strerror(errno));
+int inotify_watch_directory(struct watch_state *watch, int inotify_fd, const char *dir_path) {
+    int wd = inotify_add_watch(inotify_fd, dir_path, IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        if (!watch->out->suppress_output && !watch->out->suppress_all_output) {
+            fprintf(watch->out->errors, "Error: Cannot watch directory %s: %s%s\n", dir_path, strerror(errno),
+                    errno == ENOSPC ? " (raise fs.inotify.max_user_watches)" : "");
         }
-        return;
+        return -1;
     }
+    if (wd >= watch->npaths) {
+        int size = wd * 2 + 16;
+        char **paths = realloc(watch->paths, size * sizeof(char *));
+        if (!paths) {
+            return -1;
+        }
+        memset(paths + watch->npaths, 0, (size - watch->npaths) * sizeof(char *));
+        watch->paths = paths;
+        watch->npaths = size;
+    }
+    free(watch->paths[wd]);
+    watch->paths[wd] = strdup(dir_path);
+    return 0;
+}
 
-    mode_t old_mode = statbuf.st_mode & 0777;		// Get current permissions (last 3 digits)
-    mode_t new_mode = apply_wildcard_mode(old_mode);	// Apply the wildcard to get the new mode
-
-    // If the new permissions are the same as the old ones, skip this file/directory
-    if (old_mode == new_mode) {
-        if (!suppress_output && !suppress_all_output) {
-            if (S_ISDIR(statbuf.st_mode)) {			// If it's a directory
-                if (change_dirs || verbose) {
-                    printf("(D -> S) %s\n", path);	// outputs D -> S
+/*
+ * This function adds an inotify watch for a directory and, if the job is recursive, every directory in it.
+ * The directories still to be watched are kept on a list (a stack of their paths) on the heap, rather than
+ * recursing, so however deep the tree is, it can't overflow the thread's stack.
+ */
+void inotify_watch_tree(struct watch_state *watch, int inotify_fd, const char *root) {
+    char **pending = NULL;
+    int npending = 0, size = 0;
+    char path[PATH_MAX];
+    char *dir_path = strdup(root);
+    while (dir_path) {
+        DIR *dir;
+        if (inotify_watch_directory(watch, inotify_fd, dir_path) == 0 && watch->job->recursive &&
+                (dir = opendir(dir_path)) != NULL) {
+            struct dirent *entry;
+            while ((entry = readdir(dir)) != NULL) {
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                    continue;
+                }
+                if (watch_path(watch, path, sizeof(path), dir_path, entry->d_name) != 0) {
+                    continue;
+                }
+                struct stat statbuf;
+                if (entry->d_type != DT_DIR &&
+                        (entry->d_type != DT_UNKNOWN || lstat(path, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode))) {
+                    continue;
+                }
+                if (npending == size) {
+                    char **list = realloc(pending, (size * 2 + 16) * sizeof(char *));
+                    if (list) {
+                        pending = list;
+                        size = size * 2 + 16;
+                    }
                 }
-            } else if (S_ISREG(statbuf.st_mode)) {	// If it's a file
-                if (change_files || verbose) {
-                    printf("(F -> S) %s\n", path);	// outputs F -> S
+                char *copy = npending < size ? strdup(path) : NULL;
+                if (!copy) {
+                    if (!watch->out->suppress_output && !watch->out->suppress_all_output) {
+                        fprintf(watch->out->errors, "Error: Cannot watch directory %s: %s\n", path, strerror(ENOMEM));
+                    }
+                    continue;
                 }
+                pending[npending++] = copy;
             }
+            closedir(dir);
         }
-        return;
+        free(dir_path);
+        dir_path = npending ? pending[--npending] : NULL;
     }
-	// If it's a directory and we want to change directories
-    if (S_ISDIR(statbuf.st_mode) && change_dirs) {
-        if (chmod(path, new_mode) == 0) {
-            dirs_changed++;						// Increment count of directories changed
-            if (!suppress_output && !suppress_all_output) {
-                printf("(D ");
-                print_permissions(old_mode);	// Print the old permissions
-                printf(" -> [");
-                print_wildcard_mode();			// Print the new permissions with wildcards
-                printf("] ");
-                print_permissions(new_mode);	// Print the actual new permissions
-                printf(") %s\n", path);			// Output the directory path
-            } else {
-                if ((!suppress_output && !suppress_all_output) || verbose) {
-                    fprintf(stderr, "Error: Cannot change directory permissions %s: %s\n", path, strerror(errno));
-                }
-            }
+    free(pending);
+}
+
+/*
+ * This function handles inotify events, for as long as rper runs.
+ * The watches must have been added (inotify_watch_tree) before the first pass, so nothing is missed.
+ */
+int inotify_loop(struct watch_state *watch, int inotify_fd) {
+    char buffer[WATCH_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+
+    for (;;) {
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: Cannot read changes: %s\n", strerror(errno));
+            return EXIT_FAILURE;
         }
-	// If it's a file and we want to change files
-    } else if (S_ISREG(statbuf.st_mode) && change_files) {
-        if (chmod(path, new_mode) == 0) {
-            files_changed++;					// Increment count of files changed
-            if (!suppress_output && !suppress_all_output) {
-                printf("(F ");
-                print_permissions(old_mode);	// Print the old permissions
-                printf(" -> [");
-                print_wildcard_mode();			// Print the new permissions with wildcards
-                printf("] ");
-                print_permissions(new_mode);	// Print the actual new permissions
-                printf(") %s\n", path);			// Output the file path
+        for (char *p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                inotify_watch_tree(watch, inotify_fd, watch->root);	// directories we never heard about
+                watch_rescan(watch);
+                continue;
             }
-        } else {
-            if ((!suppress_output && !suppress_all_output) || verbose) {
-                fprintf(stderr, "Error: Cannot change file permissions %s: %s\n", path, strerror(errno));
+            if (event->wd < 0 || event->wd >= watch->npaths || !watch->paths[event->wd]) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {		// the directory is gone, so is its watch
+                free(watch->paths[event->wd]);
+                watch->paths[event->wd] = NULL;
+                continue;
+            }
+            if (!event->len) {
+                continue;						// about the watched directory itself; its parent hears about it too
             }
-		}
-	}
+
+            if (watch_path(watch, path, sizeof(path), watch->paths[event->wd], event->name) != 0) {
+                continue;
+            }
+            int is_new = (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0;
+            if (is_new && (event->mask & IN_ISDIR) && watch->job->recursive) {
+                inotify_watch_tree(watch, inotify_fd, path);	// watch it before looking inside, so nothing slips by
+            }
+            watch_entry(watch, path, is_new);
+        }
+        watch_flush(watch);
+    }
 }
 
+#ifdef FAN_REPORT_DFID_NAME
+#define WATCH_MAX_FILESYSTEMS 64				// most filesystems (the directory's, and those mounted inside it) watched
+
 /*
- * This function processes a directory. It lists all files and directories inside the
- * given directory and calls change_permissions on each one. If recursion is enabled,
- * it will call itself for any subdirectories it encounters.
+ * One filesystem fanotify watches; the kernel tells us which one an event is for by its fsid,
+ * and we need a descriptor on the same filesystem to turn the event's file handle back into a path
  */
-void process_directory(const char *dir_path, mode_t mode, int recursive, int change_files, int change_dirs, int include_dir) {
-    // If -i flag is used and we are processing directories, change the top-level directory too
-    if (change_dirs && include_dir) {
-        change_permissions(dir_path, mode, 0, 1);	// Change permissions for the top-level directory
+struct fanotify_filesystem {
+    fsid_t fsid;
+    int mount_fd;
+};
+
+/*
+ * This function adds a fanotify mark for the whole filesystem path is on, unless it already has one
+ * Returns 0 on success, -1 on failure.
+ */
+int fanotify_mark_filesystem(int fanotify_fd, const char *path, struct fanotify_filesystem *filesystems, int *count) {
+    struct statfs fs;
+    if (statfs(path, &fs) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < *count; i++) {
+        if (memcmp(&filesystems[i].fsid, &fs.f_fsid, sizeof(fs.f_fsid)) == 0) {
+            return 0;							// this filesystem is already being watched
+        }
+    }
+    if (*count == WATCH_MAX_FILESYSTEMS) {
+        return -1;
+    }
+    if (fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+            FAN_CREATE | FAN_ATTRIB | FAN_MOVED_TO | FAN_ONDIR, AT_FDCWD, path) != 0) {
+        return -1;
+    }
+    int mount_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mount_fd < 0) {
+        return -1;
     }
+    filesystems[*count].fsid = fs.f_fsid;
+    filesystems[*count].mount_fd = mount_fd;
+    (*count)++;
+    return 0;
+}
 
-    DIR *dir;					// Pointer to the directory stream
-    struct dirent *entry;		// Struct to hold the details of each entry (file/directory)
-    char path[1024];			// Buffer to store the full path of files and directories
+/*
+ * This function watches with fanotify; every filesystem the directory spans gets one mark, instead of
+ * every directory getting its own watch. It needs root (CAP_SYS_ADMIN) and Linux 5.9 or newer.
+ * Returns -1 straight away if fanotify can't be used (so inotify can be used instead), and only
+ * returns otherwise if reading events fails. The first pass is made once the marks are in place.
+ */
+int fanotify_watch(struct watch_state *watch) {
+    struct fanotify_filesystem filesystems[WATCH_MAX_FILESYSTEMS];
+    int count = 0;
+    char root[PATH_MAX];
 
-    // Try to open the directory
-    if (!(dir = opendir(dir_path))) {
-        if (!suppress_output && !suppress_all_output) {
-            fprintf(stderr, "Error: Cannot open directory %s: %s\n", dir_path, strerror(errno));
-        }
-        return;
+    if (!realpath(watch->root, root)) {
+        return -1;
+    }
+    size_t root_len = strlen(root);
+    int fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+    if (fanotify_fd < 0) {
+        return -1;								// not root, or the kernel is too old
+    }
+    if (fanotify_mark_filesystem(fanotify_fd, root, filesystems, &count) != 0) {
+        close(fanotify_fd);
+        return -1;
     }
 
-    // Loop through all entries in the directory
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip the current directory (.) and the parent directory (..)
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    // Any filesystems mounted inside the directory need their own marks
+    FILE *mounts = setmntent("/proc/self/mounts", "r");
+    struct mntent *mount;
+    while (mounts && watch->job->recursive && (mount = getmntent(mounts)) != NULL) {
+        if (strncmp(mount->mnt_dir, root, root_len) == 0 && mount->mnt_dir[root_len] == '/') {
+            if (fanotify_mark_filesystem(fanotify_fd, mount->mnt_dir, filesystems, &count) != 0 &&
+                    !watch->out->suppress_output && !watch->out->suppress_all_output) {
+                fprintf(watch->out->errors, "Error: Cannot watch filesystem %s: %s\n", mount->mnt_dir, strerror(errno));
+            }
         }
+    }
+    if (mounts) {
+        endmntent(mounts);
+    }
 
-        // Create the full path by appending the entry's name to the current directory path
-        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+    rper_run(watch->job, watch->root);			// the first pass, now nothing can be missed
+    if (watch->out->hook) {
+        hook_flush(watch->out->hook);
+    }
+    print_summary(watch->job, watch->out);
+    if (!watch->out->suppress_all_output) {
+        printf("Watching %s for changes (fanotify)\n", watch->root);
+        fflush(stdout);
+    }
+    watch->out->watching = 1;
+
+    char buffer[WATCH_BUFFER] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    char link[64], dir_path[PATH_MAX], relative[PATH_MAX], path[PATH_MAX];
+    for (;;) {
+        ssize_t len = read(fanotify_fd, buffer, sizeof(buffer));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: Cannot read changes: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        struct fanotify_event_metadata *event = (struct fanotify_event_metadata *)buffer;
+        for (; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+            if (event->mask & FAN_Q_OVERFLOW) {
+                watch_rescan(watch);
+                continue;
+            }
+            // The event tells us the directory (as a file handle) and the name of the entry in it
+            struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(event + 1);
+            if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                continue;
+            }
+            struct file_handle *handle = (struct file_handle *)fid->handle;
+            const char *name = (const char *)(handle->f_handle + handle->handle_bytes);
+            if (strcmp(name, ".") == 0) {
+                continue;						// about a directory itself, not one of its entries
+            }
 
-        // Change permissions of the file/directory
-        change_permissions(path, mode, change_files, change_dirs);
+            // Find the directory from its handle; it needs a descriptor on the same filesystem
+            int mount_fd = -1;
+            for (int i = 0; i < count; i++) {
+                if (memcmp(&filesystems[i].fsid, &fid->fsid, sizeof(fid->fsid)) == 0) {
+                    mount_fd = filesystems[i].mount_fd;
+                }
+            }
+            if (mount_fd < 0) {
+                continue;
+            }
+            int dir_fd = open_by_handle_at(mount_fd, handle, O_PATH);
+            if (dir_fd < 0) {
+                continue;						// the directory has already gone
+            }
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+            ssize_t dir_len = readlink(link, dir_path, sizeof(dir_path) - 1);
+            close(dir_fd);
+            if (dir_len < 0) {
+                continue;
+            }
+            dir_path[dir_len] = '\0';
 
-        // If recursion is enabled and this entry is a directory, process it recursively
-        if (recursive && entry->d_type == DT_DIR) {
-            process_directory(path, mode, recursive, change_files, change_dirs, include_dir);
+            // The marks cover whole filesystems; only entries inside the directory are ours
+            // (directly inside it, if the job isn't recursive)
+            if (strncmp(dir_path, root, root_len) != 0 || (dir_path[root_len] != '/' && dir_path[root_len] != '\0')) {
+                continue;
+            }
+            if (!watch->job->recursive && dir_path[root_len] != '\0') {
+                continue;
+            }
+            // Paths are shown relative to the directory as given, the same as the first pass
+            if ((size_t)snprintf(relative, sizeof(relative), "%s%s", watch->root, dir_path + root_len) >= sizeof(relative) ||
+                    watch_path(watch, path, sizeof(path), relative, name) != 0) {
+                continue;
+            }
+            watch_entry(watch, path, (event->mask & (FAN_CREATE | FAN_MOVED_TO)) != 0);
         }
+        watch_flush(watch);
     }
-
-    closedir(dir);				// Close the directory
 }
+#endif
 
 /*
- * This function validates the octal mode input by the user. It also handles cases
- * where wildcards (*) are used and ensures the octal value is valid.
+ * This function runs the watch mode; the first pass, then changes as they happen, for as long as rper runs.
+ * It only returns if watching fails.
  */
-int validate_and_process_octal(char *optarg) {
-    int len = strlen(optarg);
+int run_watch(struct rper_job *job, struct output_options *out, const char *root) {
+    struct watch_state watch = {0};
+    watch.job = job;
+    watch.out = out;
+    watch.root = root;
 
-    // Remove leading zero if present and length is 4
-    if (len == 4 && optarg[0] == '0') {
-        optarg++;  // Skip the first character
-        len--;
+#ifdef FAN_REPORT_DFID_NAME
+    if (geteuid() == 0) {
+        int result = fanotify_watch(&watch);
+        if (result != -1) {
+            return result;
+        }
     }
+#endif
 
-    // Check if the length is exactly 3 and contains only valid octal digits or wildcard (*)
-    if (len != 3 || strspn(optarg, "4567*") != 3) {
-        fprintf(stderr, "Error: Invalid octal value: %s (google: unix octal permissions)\n\n", optarg);
-        print_usage();
-        return -1;
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        fprintf(stderr, "Error: Cannot watch for changes: %s\n", strerror(errno));
+        return EXIT_FAILURE;
     }
-
-    // Copy the validated octal mode to the global wildcard_mode array
-    strncpy(wildcard_mode, optarg, 3);
-    return 0;
+    inotify_watch_tree(&watch, inotify_fd, root);
+    rper_run(job, root);						// the first pass, now nothing can be missed
+    if (out->hook) {
+        hook_flush(out->hook);
+    }
+    print_summary(job, out);
+    if (!out->suppress_all_output) {
+        printf("Watching %s for changes (inotify)\n", root);
+        fflush(stdout);
+    }
+    out->watching = 1;
+    return inotify_loop(&watch, inotify_fd);
 }
+#else
+int run_watch(struct rper_job *job, struct output_options *out, const char *root) {
+    (void)job; (void)out; (void)root;
+    fprintf(stderr, "Error: Watching for changes (--watch) needs Linux\n");
+    return EXIT_FAILURE;
+}
+#endif
 
 /*
  * The main function where the program starts. It parses command-line arguments,
- * processes the input directory, and handles errors.
+ * then hands the directory to the library (rper_run) to do the work.
  */
 int main(int argc, char *argv[]) {
     int opt;
-    int change_files = 0;		// By default, do not change files
-    int change_dirs = 0;		// By default, do not change directories
-    int recursive = 1;			// By default, process directories recursively
-    int include_dir = 0;		// By default, do not include the top-level directory
     int perm_flag = 0;			// By default, no permissions is given; will error if no permissions are given
-    mode_t mode = 0;			// The permissions mode to apply
+    const char *daemon_socket = NULL;	// By default, rper runs once; with --daemon it keeps running, taking jobs
+    int workers = 4;			// By default, the daemon runs up to 4 jobs at once
+    double max_ops = 0;			// By default, stats/chmods are not limited
+    int watch = 0;				// By default, rper exits after one pass; with --watch it keeps going
+    struct rper_histogram histogram = {0};	// only used with --histogram
+    struct rper_estimate estimate = {0};	// only used with --estimate
+    struct rper_fingerprint fingerprint = {0};	// only used with --fingerprint
+    const char *fingerprint_file = NULL;	// where --fingerprint writes to ("-" for standard output)
+    const char *compare_file = NULL;	// with --compare, the first of the two fingerprint files
+    const char *on_change = NULL;	// with --on-change, the command run on the changed entries
+    struct output_format printf_format;	// with --printf, the template, compiled
+    char *printf_text = NULL;
+    struct change_hook hook;
+    const char *stats_path = NULL;	// with --stats-file, where the metrics are kept, mapped into memory
+    const char *prom_path = NULL;	// with --prom-file, where they are written out every few seconds
+    struct stats_file *stats = NULL;
+    struct rper_metrics metrics = {0};	// used when there is a --prom-file, but no --stats-file
+    struct metrics_reporter reporter;
+    struct metrics_reporter *prom = NULL;
+    struct rper_throttle throttle;
+    struct rper_job job;		// The job to run; by default, recursive, with nothing selected
+    struct output_options out = {0};	// By default, all output is shown
+    rper_job_init(&job);
+    out.stream = stdout;
+    out.errors = stderr;
+    format_tables_init();
+
+    // Options that only have a long name; given values past any single character
+    enum { OPT_DAEMON = 256, OPT_WORKERS, OPT_MAX_OPS, OPT_WATCH, OPT_CHECK, OPT_HISTOGRAM, OPT_SAMPLE, OPT_ESTIMATE,
+           OPT_TIMEOUT, OPT_PREFETCH, OPT_POLICY, OPT_FINGERPRINT, OPT_COMPARE,
+           OPT_ON_CHANGE, OPT_PRINTF, OPT_STATS_FILE, OPT_PROM_FILE, OPT_OVERLAY, OPT_VERIFY };
+    static const struct option long_options[] = {
+        {"daemon",  required_argument, NULL, OPT_DAEMON},
+        {"workers", required_argument, NULL, OPT_WORKERS},
+        {"max-ops", required_argument, NULL, OPT_MAX_OPS},
+        {"watch",   no_argument,       NULL, OPT_WATCH},
+        {"check",   no_argument,       NULL, OPT_CHECK},
+        {"histogram", no_argument,     NULL, OPT_HISTOGRAM},
+        {"sample",  required_argument, NULL, OPT_SAMPLE},
+        {"estimate", no_argument,      NULL, OPT_ESTIMATE},
+        {"timeout", required_argument, NULL, OPT_TIMEOUT},
+        {"prefetch", required_argument, NULL, OPT_PREFETCH},
+        {"policy",  no_argument,       NULL, OPT_POLICY},
+        {"fingerprint", required_argument, NULL, OPT_FINGERPRINT},
+        {"compare", required_argument, NULL, OPT_COMPARE},
+        {"on-change", required_argument, NULL, OPT_ON_CHANGE},
+        {"printf",  required_argument, NULL, OPT_PRINTF},
+        {"stats-file", required_argument, NULL, OPT_STATS_FILE},
+        {"prom-file", required_argument, NULL, OPT_PROM_FILE},
+        {"overlay", required_argument, NULL, OPT_OVERLAY},
+        {"verify",  no_argument,       NULL, OPT_VERIFY},
+        {NULL, 0, NULL, 0}
+    };
 
-    while ((opt = getopt(argc, argv, "dfinsSvhHap:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "dfincsSvhHap:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'a':                           // prints the 'about' section
                 print_about();
@@ -307,37 +4383,141 @@ int main(int argc, char *argv[]) {
                 print_usage();
                 return EXIT_SUCCESS;            // exits, so the user can re-attempt after reading
             case 'd':
-                change_dirs = 1;                // flag so that rper make changes to directories
+                job.change_dirs = 1;            // flag so that rper make changes to directories
                 break;                          // don't exit the program
             case 'f':
-                change_files = 1;               // flag so that rper make changes to files
+                job.change_files = 1;           // flag so that rper make changes to files
                 break;
             case 'i':
-                include_dir = 1;                // flag so that rper includes the given directory
+                job.include_dir = 1;            // flag so that rper includes the given directory
                 break;
             case 'n':
-                recursive = 0;                  // rper is recursive by default, '0' turns it off
+                job.recursive = 0;              // rper is recursive by default, '0' turns it off
+                break;
+            case 'c':
+                if (!printf_text) {
+                    out.changed = &format_changed_rwx;	// permissions in rwx notation; --printf says for itself
+                }
                 break;
             case 's':
-                suppress_output = 1;
-                suppress_all_output = 0;        // if -s is used, ignore -S
+                out.suppress_output = 1;
+                out.suppress_all_output = 0;    // if -s is used, ignore -S
                 break;
             case 'S':
-                if (!suppress_output) {         // only set suppress_all_output if -s is not set
-                    suppress_all_output = 1;    // making extra sure that 's' gets precedence over 'S'
+                if (!out.suppress_output) {     // only set suppress_all_output if -s is not set
+                    out.suppress_all_output = 1;	// making extra sure that 's' gets precedence over 'S'
                 }
                 break;
             case 'v':
-                verbose = 1;					// Enable verbose mode, ensures all output is shown
-                suppress_output = 0;            // ignore -s if -v is used
-                suppress_all_output = 0;        // ignore -S if -v is used
+                out.verbose = 1;				// Enable verbose mode, ensures all output is shown
+                out.suppress_output = 0;        // ignore -s if -v is used
+                out.suppress_all_output = 0;    // ignore -S if -v is used
                 break;
             case 'p':
-                if (validate_and_process_octal(optarg) == -1) {
+                if (validate_and_process_octal(optarg, &job.mode) == -1) {
                     return EXIT_FAILURE;		// Exit if the octal value is invalid
                 }
                 perm_flag =1;
                 break;
+            case OPT_DAEMON:
+                daemon_socket = optarg;         // where the daemon listens for jobs
+                break;
+            case OPT_WORKERS:
+                workers = atoi(optarg);
+                if (workers < 1) {
+                    fprintf(stderr, "Error: Invalid number of workers: %s\n\n", optarg);
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_WATCH:
+                watch = 1;                      // keep going after the first pass, looking only at what changes
+                break;
+            case OPT_CHECK:
+                job.check = 1;                  // only look; change nothing, and exit with failure if anything would change
+                break;
+            case OPT_HISTOGRAM:
+                job.histogram = &histogram;     // count the permissions found
+                break;
+            case OPT_SAMPLE: {
+                // a fraction (0.01) or a percentage (1%)
+                char *end;
+                job.sample_rate = strtod(optarg, &end);
+                if (*end == '%') {
+                    job.sample_rate /= 100;
+                    end++;
+                }
+                if (*end || job.sample_rate <= 0 || job.sample_rate > 1) {
+                    fprintf(stderr, "Error: Invalid sample rate: %s (eg. 0.01 or 1%%)\n\n", optarg);
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                job.sample_seed = (unsigned long long)time(NULL) ^ ((unsigned long long)getpid() << 32);
+                job.check = 1;                  // a sample only ever looks
+                break;
+            }
+            case OPT_ESTIMATE:
+                job.estimate = &estimate;       // only count, to see how big a job is
+                break;
+            case OPT_MAX_OPS:
+                max_ops = atof(optarg);
+                if (max_ops <= 0) {
+                    fprintf(stderr, "Error: Invalid operations per second: %s\n\n", optarg);
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_TIMEOUT:
+                job.op_timeout = atof(optarg);  // give up on anything taking longer, rather than hang
+                if (job.op_timeout <= 0) {
+                    fprintf(stderr, "Error: Invalid timeout: %s\n\n", optarg);
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_POLICY:
+                job.policy = 1;                 // modes can come from .rperpolicy files too
+                break;
+            case OPT_VERIFY:
+                job.verify = 1;                 // read back what's changed
+                break;
+            case OPT_FINGERPRINT:
+                fingerprint_file = optarg;      // only hash the permissions, to compare with another tree's
+                job.fingerprint = &fingerprint;
+                break;
+            case OPT_COMPARE:
+                compare_file = optarg;          // the other is the last argument, in place of the directory
+                break;
+            case OPT_PRINTF:
+                free(printf_text);
+                if (format_compile(optarg, &printf_format, &printf_text) != 0) {
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                out.changed = out.skipped = &printf_format;	// one template for both; %a tells them apart
+                break;
+            case OPT_OVERLAY:
+                if (parse_overlay(optarg, &job) != 0) {	// what to do about copy-ups on overlay filesystems
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_STATS_FILE:
+                stats_path = optarg;            // live counters, for monitoring
+                break;
+            case OPT_PROM_FILE:
+                prom_path = optarg;             // the same, for Prometheus
+                break;
+            case OPT_ON_CHANGE:
+                on_change = optarg;             // run on the changed entries, in batches
+                break;
+            case OPT_PREFETCH:
+                job.prefetch = atoi(optarg);    // threads warming the cache ahead of the walk
+                if (job.prefetch < 1) {
+                    fprintf(stderr, "Error: Invalid number of prefetch threads: %s\n\n", optarg);
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
             default:
                 fprintf(stderr, "Error: Unknown (please see usage)\n\n");
                 print_usage();
@@ -345,6 +4525,26 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // The daemon takes its directories and permissions from each job instead
+    if (daemon_socket && (stats_path || prom_path)) {
+        fprintf(stderr, "Error: --stats-file and --prom-file can't be used with --daemon\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (daemon_socket) {
+        return run_daemon(daemon_socket, workers, max_ops, job.op_timeout);
+    }
+
+    // Comparing fingerprints doesn't look at any directory, only at the two files
+    if (compare_file) {
+        if (optind >= argc) {
+            fprintf(stderr, "Error: Missing second fingerprint file (--compare <file> <file>)\n\n");
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        return run_compare(compare_file, argv[optind], &out);
+    }
+
     // Check if the user provided a directory as an argument
     if (optind >= argc) {
         fprintf(stderr, "Error: Missing directory argument (directory argument should be last)\n\n");
@@ -352,7 +4552,7 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
     
-    if (!perm_flag) {
+    if (!perm_flag && !job.estimate && !job.fingerprint && !job.policy) {	// estimates and fingerprints don't need to know the permissions, nor do policies
         fprintf(stderr, "Error: No permissions detected (use -p)\n\n");
         print_usage();
         return EXIT_FAILURE;
@@ -361,20 +4561,176 @@ int main(int argc, char *argv[]) {
     const char *directory = argv[optind];
 
     // Default behavior if neither -f nor -d is specified
-    if (!change_files && !change_dirs) {
-        change_files = 1;
+    if (!job.change_files && !job.change_dirs) {
+        job.change_files = 1;
+    }
+
+    if (max_ops > 0 && job.prefetch) {
+        fprintf(stderr, "Error: --prefetch and --max-ops can't be used together\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (max_ops > 0) {
+        rper_throttle_init(&throttle, max_ops);
+        job.throttle = &throttle;
+    }
+
+    // A hook needs changes to have been made, and (whatever the output) to hear about every one
+    if (on_change) {
+        if (job.check || job.estimate || job.fingerprint) {
+            fprintf(stderr, "Error: --on-change can't be used with --check, --sample, --estimate or --fingerprint\n\n");
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        if (hook_init(&hook, on_change, out.suppress_all_output) != 0) {
+            fprintf(stderr, "Error: --on-change: %s%s\n", strerror(errno), errno == E2BIG ? " (the environment is too big)" : "");
+            hook_free(&hook);
+            return EXIT_FAILURE;
+        }
+        out.hook = &hook;
+    }
+
+    // Verifying reads back changes, so there have to have been some
+    if (job.verify && (job.check || job.estimate || job.fingerprint)) {
+        fprintf(stderr, "Error: --verify can't be used with --check, --sample, --estimate or --fingerprint\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    // A check on an overlay filesystem also says what copying up from lower layers a real run would do;
+    // only there, so checks elsewhere don't pay for looking
+    if (job.check && !job.overlay && overlay_is_on(directory)) {
+        job.overlay = RPER_OVERLAY_COUNT;
+    }
+
+    // Only verbose output needs to hear about the types that weren't selected
+    job.report_all = out.verbose;
+    if ((!out.suppress_output && !out.suppress_all_output) || out.hook) {
+        job.on_event = print_event;				// with all output suppressed there is nobody to tell
+        job.user = &out;
+    }
+
+    // Live metrics, for monitoring; kept by the job, in the stats file if there is one
+    if (stats_path && !(stats = stats_file_open(stats_path))) {
+        return EXIT_FAILURE;
+    }
+    if (stats_path || prom_path) {
+        job.metrics = stats ? &stats->metrics : &metrics;
+    }
+    if (prom_path) {
+        if (metrics_reporter_start(&reporter, prom_path, job.metrics) != 0) {
+            metrics_finish(stats, NULL);
+            return EXIT_FAILURE;
+        }
+        prom = &reporter;
+    }
+
+    // An estimate only counts what a run would have to look at, and how long that would take
+    if (job.estimate) {
+        if (job.fingerprint) {
+            fprintf(stderr, "Error: --estimate and --fingerprint can't be used together\n\n");
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rper_run(&job, directory);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!out.suppress_all_output) {
+            print_estimate(&job, out.stream, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, max_ops);
+        }
+        metrics_finish(stats, prom);
+        rper_job_free(&job);
+        return EXIT_SUCCESS;
+    }
+
+    // A fingerprint only hashes what is there; errors are still shown, as they leave it incomplete
+    if (job.fingerprint) {
+        if (watch || job.check || job.histogram || job.policy) {
+            fprintf(stderr, "Error: --fingerprint can't be used with --watch, --check, --sample, --histogram or --policy\n\n");
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        int to_stdout = strcmp(fingerprint_file, "-") == 0;
+        fingerprint.out = to_stdout ? stdout : fopen(fingerprint_file, "w");
+        if (!fingerprint.out) {
+            fprintf(stderr, "Error: Cannot write fingerprints to %s: %s\n", fingerprint_file, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        rper_run(&job, directory);
+        if ((to_stdout ? fflush(stdout) : fclose(fingerprint.out)) != 0) {
+            fprintf(stderr, "Error: Cannot write fingerprints to %s: %s\n", fingerprint_file, strerror(errno));
+            job.errors++;
+        }
+        if (!out.suppress_all_output && !to_stdout) {	// the fingerprints themselves are the output then
+            fprintf(out.stream, "Fingerprint completed.\n");
+            fprintf(out.stream, "Directories: %ld\n", fingerprint.dirs);
+            fprintf(out.stream, "Fingerprint: %016llx\n", fingerprint.root);
+        }
+        metrics_finish(stats, prom);
+        rper_job_free(&job);
+        return job.errors || job.nabandoned ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // Keep going after the first pass, looking only at what changes
+    if (watch && (job.check || job.policy)) {
+        // a change deep in the tree is looked at on its own, without the policies above it
+        fprintf(stderr, "Error: --watch and --%s can't be used together\n\n", job.check ? "check" : "policy");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (watch) {
+        int result = run_watch(&job, &out, directory);
+        metrics_finish(stats, prom);
+        return result;
     }
 
     // Start processing the directory
-    process_directory(directory, mode, recursive, change_files, change_dirs, include_dir);
-    //process_directory(directory, 0, recursive, change_files, change_dirs, include_dir);
+    rper_run(&job, directory);
+    if (out.hook) {
+        hook_finish(out.hook);					// the last batch, and every one still running
+    }
+    metrics_finish(stats, prom);
 
     // Print the final completion summary unless all output is suppressed
-    if (!suppress_all_output) {
-        printf("Operation completed.\n");
-        printf("Files changed: %d\n", files_changed);
-        printf("Directories changed: %d\n", dirs_changed);
+    print_summary(&job, &out);
+    if (job.histogram) {
+        if (!out.suppress_all_output) {
+            print_histogram(job.histogram, out.stream);
+        }
+        rper_histogram_free(job.histogram);
+    }
+    int mismatches = job.nmismatches + job.nunverified;
+    int abandoned = job.nabandoned;
+    rper_job_free(&job);
+
+    // When checking, anything left to change means the directory isn't as it should be; and if some of it
+    // couldn't be looked at, nobody can say it is
+    if (job.check && (job.files_changed || job.dirs_changed)) {
+        return EXIT_FAILURE;
+    }
+    if (job.check && job.errors) {
+        return EXIT_INCOMPLETE;
+    }
+    if (printf_text) {
+        free((void *)printf_format.ops);
+        free(printf_text);
+    }
+    if (out.hook) {
+        long failed = out.hook->failed;
+        hook_free(out.hook);
+        if (failed) {
+            return EXIT_FAILURE;				// the changes were made, but what should have followed them wasn't
+        }
+    }
+    if (mismatches) {
+        return EXIT_FAILURE;					// changes were made, but some didn't keep (or can't be said to have)
+    }
+    if (abandoned) {
+        return EXIT_FAILURE;					// the same as --fingerprint; what was given up on needs another run
     }
 
     return EXIT_SUCCESS;                        // Exit with success, returns '0'
 }
+
+#endif
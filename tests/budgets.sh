@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# rper's budget tests: what rper costs per entry, in metadata syscalls and allocations, locked in.
+#
+# Each case is run over two generated trees, one twice the size of the other, with syscount.so preloaded
+# (see syscount.c) to count the calls made. The difference between the two runs, divided by the entries
+# added, is the cost of an entry; fixed costs (starting up, the directory given) cancel out. Fails (exit 1)
+# if any case goes over its budget.
+#
+# Usage:
+#   sh tests/budgets.sh                 (RPER_SOURCE, CC and DIRS can be set to change what's built, and the trees' size)
+#
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+source=${RPER_SOURCE:-$here/../rper_0.1.c}
+cc=${CC:-gcc}
+dirs=${DIRS:-40}							# top-level directories in the smaller tree; the larger has twice as many
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT INT TERM
+umask 022									# files are made 644, directories 755
+
+$cc -O2 -pthread -o "$work/rper" "$source" -lm
+$cc -shared -fPIC -O2 -o "$work/syscount.so" "$here/syscount.c" -ldl
+
+#
+# A tree of n top-level directories, each with 40 files, and a subdirectory with 10 more;
+# 52 entries for each top-level directory (53 with the directory itself)
+#
+make_tree() {
+    mkdir "$1"
+    i=1
+    while [ "$i" -le "$2" ]; do
+        mkdir -p "$1/d$i/sub"
+        (cd "$1/d$i" && touch f1 f2 f3 f4 f5 f6 f7 f8 f9 f10 f11 f12 f13 f14 f15 f16 f17 f18 f19 f20 \
+            f21 f22 f23 f24 f25 f26 f27 f28 f29 f30 f31 f32 f33 f34 f35 f36 f37 f38 f39 f40 \
+            && cd sub && touch g1 g2 g3 g4 g5 g6 g7 g8 g9 g10)
+        i=$((i + 1))
+    done
+}
+make_tree "$work/small" "$dirs"
+make_tree "$work/large" $((dirs * 2))
+entries=$((dirs * 52))						# added by the larger tree
+
+# Puts both trees back as they were made (644 files, 755 directories); not counted
+reset_trees() {
+    chmod -R u=rwX,go=rX "$work/small" "$work/large"
+}
+
+# Runs rper (with the arguments given, then the tree) under syscount, leaving the counts in $work/<name>
+count() {
+    name=$1 tree=$2
+    shift 2
+    SYSCOUNT_OUT="$work/$name" LD_PRELOAD="$work/syscount.so" "$work/rper" "$@" "$work/$tree" >/dev/null 2>&1 || true
+}
+
+failed=0
+printf '%-28s %8s %8s %8s %8s %8s %8s   (per entry)\n' case stat chmod open getdents path malloc
+
+#
+# Runs a case, and checks its costs per entry against the budgets given, as 'counter<=limit' (limits can be fractions);
+# 'syscalls' is stat + chmod + open + getdents. Unless a case says otherwise, path lookups and allocations
+# are checked too: neither may grow with the tree.
+#
+check() {
+    label=$1 args=$2
+    shift 2
+    reset_trees
+    # shellcheck disable=SC2086
+    count small.counts small $args
+    reset_trees
+    # shellcheck disable=SC2086
+    count large.counts large $args
+    result=$(awk -v entries="$entries" -v label="$label" -v budgets="path<=0 malloc<=0 $*" '
+        FNR == NR { small[$1] = $2; next }
+        { cost[$1] = ($2 - small[$1]) / entries }
+        END {
+            cost["syscalls"] = cost["stat"] + cost["chmod"] + cost["open"] + cost["getdents"]
+            printf "%-28s %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f", label, cost["stat"], cost["chmod"], cost["open"],
+                cost["getdents"], cost["path"], cost["malloc"]
+            n = split(budgets, list, " ")
+            for (i = 1; i <= n; i++) {
+                split(list[i], budget, "<=")
+                limit[budget[1]] = budget[2] + 0		# a case can give its own, in place of the defaults
+            }
+            over = ""
+            for (counter in limit) {
+                if (cost[counter] > limit[counter]) {
+                    over = over sprintf(" %s %.3f>%s", counter, cost[counter], limit[counter])
+                }
+            }
+            if (over != "") {
+                printf "   OVER BUDGET:%s", over
+            }
+            printf "\n"
+        }' "$work/small.counts" "$work/large.counts")
+    echo "$result"
+    case $result in
+        *"OVER BUDGET"*) failed=1 ;;
+    esac
+}
+
+# Files already right: a stat each, and nothing else (directories are read, not stat'ed; their type is in d_type)
+check "files, unchanged"            "-s -p 644"                     "syscalls<=2" "chmod<=0"
+# Files changed: a stat and a chmod each
+check "files, changed"              "-s -p 444"                     "syscalls<=3" "chmod<=1"
+# Directories only: files are never stat'ed (d_type says they're files), so only directories cost anything;
+# 2 of each 52 entries are directories, so that's a stat and an open (and its reads) for every 26 entries
+check "directories only"            "-s -d -p 755"                  "stat<=0.04" "syscalls<=0.16"
+# The same, with a thread watching for hung operations (--timeout)
+check "timeout"                     "-s --timeout 30 -p 444"        "syscalls<=3"
+# Prefetching: its threads read and stat ahead, the walk the same as ever. They find directories by path (one
+# lookup each), and a directory waiting to be read has a record (recycled, but as many as are waiting at once)
+check "prefetch"                    "-s --prefetch 2 -p 444"        "syscalls<=6" "path<=0.04" "malloc<=0.04"
+# Files and directories changed, with every change shown
+check "both, changed, output"       "-d -f -p 444"                  "syscalls<=3"
+# An audit: the same as a run that changes nothing (no overlay lookups off an overlay filesystem, so no
+# more stats than there are files)
+check "check"                       "-s --check -p 444"             "syscalls<=2" "chmod<=0" "stat<=0.97"
+# Reading back what was changed: one more stat per change
+check "verify"                      "-s --verify -p 444"            "syscalls<=4"
+# A policy: one more open per directory (to look for its .rperpolicy)
+check "policy"                      "-s --policy -p 444"            "syscalls<=3.1"
+
+if [ "$failed" -ne 0 ]; then
+    echo "FAILED: over budget (see above)"
+    exit 1
+fi
+echo "OK: every case within budget"
@@ -0,0 +1,273 @@
+/*
+syscount: counts the metadata syscalls (and allocations) a program makes, for rper's budget tests (see budgets.sh)
+
+Built as a shared library, and loaded ahead of libc with LD_PRELOAD; each call it counts is passed straight on
+to libc. When the program exits, the counts are written to the file named by SYSCOUNT_OUT, one 'name count' a line.
+
+Building:
+    gcc -shared -fPIC -O2 -o syscount.so syscount.c -ldl
+
+Counted:
+    stat      lstat, stat, fstatat, statx, fstat, and fstatfs/statfs (and their 64-bit and older __xstat forms)
+    chmod     chmod, fchmod, fchmodat
+    open      open, openat (and 64-bit forms), and opendir (which glibc opens with internally, out of sight)
+    getdents  getdents64 (readdir's reads are glibc's own, so not counted)
+    path      of those, lookups by path rather than by a single name in an open directory; any call without
+              'at' (lstat, stat, chmod, open), and any 'at' call given a name with a '/' in it
+    malloc    malloc, calloc, realloc
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>              // dlsym(RTLD_NEXT), to find libc's own functions
+#include <stdarg.h>             // the mode argument of open/openat
+#include <stdio.h>              // snprintf, for writing the counts
+#include <stdlib.h>             // getenv
+#include <string.h>             // strchr
+#include <fcntl.h>              // O_CREAT, O_TMPFILE
+#include <unistd.h>             // write, close
+#include <dirent.h>             // getdents64, opendir
+#include <sys/stat.h>           // struct stat, struct statx
+#include <sys/vfs.h>            // struct statfs
+
+enum { COUNT_STAT, COUNT_CHMOD, COUNT_OPEN, COUNT_GETDENTS, COUNT_PATH, COUNT_MALLOC, NCOUNTS };
+static const char *count_names[NCOUNTS] = {"stat", "chmod", "open", "getdents", "path", "malloc"};
+static unsigned long counts[NCOUNTS];
+static int counting = 1;						// cleared once the counts are being written out
+
+// Counts are added to from any thread (eg. rper's prefetch), so atomically
+#define COUNT(what) do { if (counting) __atomic_fetch_add(&counts[what], 1, __ATOMIC_RELAXED); } while (0)
+#define COUNT_PATH_IF(at, name) do { if (!(at) || strchr(name, '/')) COUNT(COUNT_PATH); } while (0)
+
+// The real function, looked up on first use
+#define REAL(name, ret, args) static ret (*real_##name) args; \
+    if (!real_##name) real_##name = (ret (*) args)dlsym(RTLD_NEXT, #name)
+
+/* Allocations. glibc exports its own allocator as __libc_*, so these don't need dlsym (which allocates itself) */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    COUNT(COUNT_MALLOC);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    COUNT(COUNT_MALLOC);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    COUNT(COUNT_MALLOC);
+    return __libc_realloc(ptr, size);
+}
+
+/* Stats */
+int fstatat(int dirfd, const char *name, struct stat *statbuf, int flags) {
+    REAL(fstatat, int, (int, const char *, struct stat *, int));
+    COUNT(COUNT_STAT);
+    COUNT_PATH_IF(1, name);
+    return real_fstatat(dirfd, name, statbuf, flags);
+}
+
+int fstatat64(int dirfd, const char *name, struct stat64 *statbuf, int flags) {
+    REAL(fstatat64, int, (int, const char *, struct stat64 *, int));
+    COUNT(COUNT_STAT);
+    COUNT_PATH_IF(1, name);
+    return real_fstatat64(dirfd, name, statbuf, flags);
+}
+
+int __fxstatat(int version, int dirfd, const char *name, struct stat *statbuf, int flags) {
+    REAL(__fxstatat, int, (int, int, const char *, struct stat *, int));
+    COUNT(COUNT_STAT);
+    COUNT_PATH_IF(1, name);
+    return real___fxstatat(version, dirfd, name, statbuf, flags);
+}
+
+int __fxstatat64(int version, int dirfd, const char *name, struct stat64 *statbuf, int flags) {
+    REAL(__fxstatat64, int, (int, int, const char *, struct stat64 *, int));
+    COUNT(COUNT_STAT);
+    COUNT_PATH_IF(1, name);
+    return real___fxstatat64(version, dirfd, name, statbuf, flags);
+}
+
+int statx(int dirfd, const char *name, int flags, unsigned int mask, struct statx *statxbuf) {
+    REAL(statx, int, (int, const char *, int, unsigned int, struct statx *));
+    COUNT(COUNT_STAT);
+    COUNT_PATH_IF(1, name);
+    return real_statx(dirfd, name, flags, mask, statxbuf);
+}
+
+int lstat(const char *path, struct stat *statbuf) {
+    REAL(lstat, int, (const char *, struct stat *));
+    COUNT(COUNT_STAT);
+    COUNT(COUNT_PATH);
+    return real_lstat(path, statbuf);
+}
+
+int lstat64(const char *path, struct stat64 *statbuf) {
+    REAL(lstat64, int, (const char *, struct stat64 *));
+    COUNT(COUNT_STAT);
+    COUNT(COUNT_PATH);
+    return real_lstat64(path, statbuf);
+}
+
+int stat(const char *path, struct stat *statbuf) {
+    REAL(stat, int, (const char *, struct stat *));
+    COUNT(COUNT_STAT);
+    COUNT(COUNT_PATH);
+    return real_stat(path, statbuf);
+}
+
+int stat64(const char *path, struct stat64 *statbuf) {
+    REAL(stat64, int, (const char *, struct stat64 *));
+    COUNT(COUNT_STAT);
+    COUNT(COUNT_PATH);
+    return real_stat64(path, statbuf);
+}
+
+int __lxstat(int version, const char *path, struct stat *statbuf) {
+    REAL(__lxstat, int, (int, const char *, struct stat *));
+    COUNT(COUNT_STAT);
+    COUNT(COUNT_PATH);
+    return real___lxstat(version, path, statbuf);
+}
+
+int __xstat(int version, const char *path, struct stat *statbuf) {
+    REAL(__xstat, int, (int, const char *, struct stat *));
+    COUNT(COUNT_STAT);
+    COUNT(COUNT_PATH);
+    return real___xstat(version, path, statbuf);
+}
+
+int fstat(int fd, struct stat *statbuf) {
+    REAL(fstat, int, (int, struct stat *));
+    COUNT(COUNT_STAT);
+    return real_fstat(fd, statbuf);
+}
+
+int fstat64(int fd, struct stat64 *statbuf) {
+    REAL(fstat64, int, (int, struct stat64 *));
+    COUNT(COUNT_STAT);
+    return real_fstat64(fd, statbuf);
+}
+
+int fstatfs(int fd, struct statfs *statfsbuf) {
+    REAL(fstatfs, int, (int, struct statfs *));
+    COUNT(COUNT_STAT);
+    return real_fstatfs(fd, statfsbuf);
+}
+
+int statfs(const char *path, struct statfs *statfsbuf) {
+    REAL(statfs, int, (const char *, struct statfs *));
+    COUNT(COUNT_STAT);
+    COUNT(COUNT_PATH);
+    return real_statfs(path, statfsbuf);
+}
+
+/* Changing permissions */
+int chmod(const char *path, mode_t mode) {
+    REAL(chmod, int, (const char *, mode_t));
+    COUNT(COUNT_CHMOD);
+    COUNT(COUNT_PATH);
+    return real_chmod(path, mode);
+}
+
+int fchmod(int fd, mode_t mode) {
+    REAL(fchmod, int, (int, mode_t));
+    COUNT(COUNT_CHMOD);
+    return real_fchmod(fd, mode);
+}
+
+int fchmodat(int dirfd, const char *name, mode_t mode, int flags) {
+    REAL(fchmodat, int, (int, const char *, mode_t, int));
+    COUNT(COUNT_CHMOD);
+    COUNT_PATH_IF(1, name);
+    return real_fchmodat(dirfd, name, mode, flags);
+}
+
+/* Opening, and reading directories */
+static mode_t open_mode(int flags, va_list args) {
+    return (flags & (O_CREAT | O_TMPFILE)) ? va_arg(args, mode_t) : 0;
+}
+
+int open(const char *path, int flags, ...) {
+    REAL(open, int, (const char *, int, ...));
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = open_mode(flags, args);
+    va_end(args);
+    COUNT(COUNT_OPEN);
+    COUNT(COUNT_PATH);
+    return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+    REAL(open64, int, (const char *, int, ...));
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = open_mode(flags, args);
+    va_end(args);
+    COUNT(COUNT_OPEN);
+    COUNT(COUNT_PATH);
+    return real_open64(path, flags, mode);
+}
+
+int openat(int dirfd, const char *name, int flags, ...) {
+    REAL(openat, int, (int, const char *, int, ...));
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = open_mode(flags, args);
+    va_end(args);
+    COUNT(COUNT_OPEN);
+    COUNT_PATH_IF(1, name);
+    return real_openat(dirfd, name, flags, mode);
+}
+
+int openat64(int dirfd, const char *name, int flags, ...) {
+    REAL(openat64, int, (int, const char *, int, ...));
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = open_mode(flags, args);
+    va_end(args);
+    COUNT(COUNT_OPEN);
+    COUNT_PATH_IF(1, name);
+    return real_openat64(dirfd, name, flags, mode);
+}
+
+DIR *opendir(const char *path) {
+    REAL(opendir, DIR *, (const char *));
+    COUNT(COUNT_OPEN);
+    COUNT(COUNT_PATH);
+    return real_opendir(path);
+}
+
+ssize_t getdents64(int fd, void *buffer, size_t size) {
+    REAL(getdents64, ssize_t, (int, void *, size_t));
+    COUNT(COUNT_GETDENTS);
+    return real_getdents64(fd, buffer, size);
+}
+
+/*
+ * This function writes the counts out, once the program is done (with exit, or returning from main)
+ */
+__attribute__((destructor))
+static void syscount_write(void) {
+    counting = 0;								// what's done from here on is ours, not the program's
+    const char *file = getenv("SYSCOUNT_OUT");
+    if (!file) {
+        return;
+    }
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    char line[64];
+    for (int i = 0; i < NCOUNTS; i++) {
+        int len = snprintf(line, sizeof(line), "%s %lu\n", count_names[i], __atomic_load_n(&counts[i], __ATOMIC_RELAXED));
+        if (write(fd, line, len) != len) {
+            break;
+        }
+    }
+    close(fd);
+}